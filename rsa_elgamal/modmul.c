@@ -7,6 +7,18 @@
 
 #include "modmul.h"
 
+// options, set from the command line by main
+int    opt_parallel_crt = 0;    // --parallel-crt: run the CRT halves of stage2 on a worker per prime
+int    opt_simd         = 1;    // --no-simd:      do not use the multi-buffer exponentiation, even if the CPU can
+size_t opt_threads      = 1;    // --threads=N:    compute the challenges of each batch on N threads
+size_t opt_batch        = 256;  // --batch=N:      read N challenges per batch, see stage_run
+size_t opt_precompute   = 0;    // --precompute=D: keep up to D ephemeral keys per stage3 public key precomputed
+size_t opt_primes       = 2;    // --primes=U:     read stage2 keys of U primes, 2 <= U <= RSA_PRIMES_MAX
+size_t opt_cache        = 4096; // --cache=K:      keep up to K KiB of params of recently seen moduli per worker
+int    opt_cache_stats  = 0;    // --cache-stats:  report the hits, misses and evictions of those caches on stderr
+
+elgamal_precomp_t stage3_precomp; // the precomputed ephemeral keys of stage3, shared by all workers
+
 /* Perform stage 1:
  *
  * - read each 3-tuple of N, e and m from stdin,
@@ -15,197 +27,255 @@
  */
 
 void stage1() {
+  stage_run( &stage1_def );
+}
 
-  // read each 3-tuple of N, e and m from stdin
-  // 1024-bit line + terminator
-  char * N_str = NULL;
-  char * e_str = NULL;
-  char * m_str = NULL;
-  size_t line_size;
-
-  // init mpz_t's for N, e, m
-  mpz_t N, e, m;
-  mpz_init(N);
-  mpz_init(e);
-  mpz_init(m);
-
-  // read challenges from stdin forever
-  int i = 0;
-  while (1) {
-    int run = _stage1_read_challenge( &N_str, &e_str, &m_str, &line_size );
-    if (!run) return; // no more challenges
-
-    // assign N, e, m, interpreting input as hex integer literals
-    if ( mpz_set_str( N, N_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i     );
-      return;
-    }
-    if ( mpz_set_str( e, e_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 1 );
-      return;
-    }
-    if ( mpz_set_str( m, m_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 2 );
-      return;
-    }
+const stage_t stage1_def = {
+  sizeof( stage1_challenge_t ), sizeof( stage1_state_t ),
+  _stage1_challenge_init, _stage1_challenge_clear, _stage1_state_init, _stage1_state_clear,
+  _stage1_read, _stage1_compute, _stage1_write, _stage1_compute_run
+};
+
+void _stage1_challenge_init( void * challenge ) {
+  stage1_challenge_t * ch = challenge;
+  mpz_init( ch->N );
+  mpz_init( ch->e );
+  mpz_init( ch->m );
+  mpz_init( ch->c );
+}
 
-    // init mpz_t's for ciphertext c
-    mpz_t c;
-    mpz_init( c );
+void _stage1_challenge_clear( void * challenge ) {
+  stage1_challenge_t * ch = challenge;
+  mpz_clear( ch->N );
+  mpz_clear( ch->e );
+  mpz_clear( ch->m );
+  mpz_clear( ch->c );
+}
 
-    // calculate c using RSA
-    sliding_window_expm( c, m, e, N );
+// the multi-buffer exponentiation buffers of a worker, and the params of the moduli it has seen, which the
+// exponentiations take from the cache rather than recompute when N repeats
+void _stage1_state_init( void * state ) {
+  stage1_state_t * st = state;
+  mb_ctx_init( st->mb );
+  modulus_cache_init( st->cache, opt_cache * 1024 );
+  if ( opt_cache > 0 )
+    st->mb->cache = st->cache;
+}
 
-    // print c to stdout
-    gmp_printf( "%ZX\n", c );
+void _stage1_state_clear( void * state ) {
+  stage1_state_t * st = state;
+  mb_ctx_clear( st->mb );
+  modulus_cache_clear( st->cache );
+}
 
-    // incr line counter (we parsed 3 lines from stdin this loop)
-    i += 3;
-  }
+int _stage1_read( void * challenge, hex_reader_t * in ) {
+  stage1_challenge_t * ch = challenge;
 
-  mpz_clear(N);
-  mpz_clear(e);
-  mpz_clear(m);
+  // assign N, e, m, interpreting input as hex integer literals
+  mpz_ptr fields[] = { ch->N, ch->e, ch->m };
+  return _stage_read_fields( in, fields, 3 );
+}
 
+void _stage1_compute( void * challenge, void * state ) {
+  _stage1_compute_run( challenge, 1, state );
 }
 
-int _stage1_read_challenge( char ** N_str, char ** e_str, char ** m_str, size_t * line_size ) {
-  int run = 1;
-  if ( getline(N_str, line_size, stdin) == -1 ||
-       getline(e_str, line_size, stdin) == -1 ||
-       getline(m_str, line_size, stdin) == -1
-     ) {
-    run = 0;
+// Computes a run of n consecutive challenges, MB_LANES encryptions at a time.
+void _stage1_compute_run( void * challenges, size_t n, void * state ) {
+  stage1_challenge_t * ch = challenges;
+  stage1_state_t     * st = state;
+
+  for ( size_t i = 0; i < n; i += MB_LANES ) {
+    size_t  k = ( n - i < MB_LANES ) ? n - i : MB_LANES;
+    mpz_ptr c[ k ], m[ k ], e[ k ], N[ k ];
+    for ( size_t j = 0; j < k; j++ ) {
+      c[j] = ch[ i + j ].c;
+      m[j] = ch[ i + j ].m;
+      e[j] = ch[ i + j ].e;
+      N[j] = ch[ i + j ].N;
+    }
+
+    // calculate c using RSA
+    mb_expm( c, m, e, N, k, st->mb );
   }
-  return run;
+}
+
+void _stage1_write( void * challenge, hex_writer_t * out ) {
+  stage1_challenge_t * ch = challenge;
+
+  // print c to stdout
+  hex_writer_put( out, ch->c );
 }
 
 
+
 /* Perform stage 2:
  *
- * - read each 9-tuple of N, d, p, q, d_p, d_q, i_p, i_q and c from stdin,
+ * - read each 9-tuple of N, d, p, q, d_p, d_q, i_p, i_q and c from stdin, or with --primes=U each
+ *   (3U + 3)-tuple with the prime r_i, exponent d_i and Garner coefficient t_i of each prime after q before c,
  * - compute the RSA decryption m, then
  * - write the plaintext m to stdout.
  */
 
 void stage2() {
+  stage_run( &stage2_def );
+}
 
-  // 1024-bit line + terminator
-  char * N_str   = NULL;
-  char * d_str   = NULL;
-  char * p_str   = NULL;
-  char * q_str   = NULL;
-  char * d_p_str = NULL;
-  char * d_q_str = NULL;
-  char * i_p_str = NULL;
-  char * i_q_str = NULL;
-  char * c_str   = NULL;
-  size_t line_size;
-
-  // init mpz_t's
-  mpz_t N, d, p, q, d_p, d_q, i_p, i_q, c, c_p, c_q, m;
-  mpz_init(N);
-  mpz_init(d);
-  mpz_init(p);
-  mpz_init(q);
-  mpz_init(d_p);
-  mpz_init(d_q);
-  mpz_init(i_p);
-  mpz_init(i_q);
-  mpz_init(c);
-  mpz_init(c_p);
-  mpz_init(c_q);
-  mpz_init(m);
-
-  // read challenges from stdin forever
-  int i = 0;
-  while (1) {
-    int run = _stage2_read_challenge( &N_str, &d_str, &p_str, &q_str, &d_p_str, &d_q_str,
-                                      &i_p_str, &i_q_str, &c_str, &line_size );
-    if (!run) return; // no more challenges
-
-    // assign N, d, c, interpreting input as hex integer literals
-    if ( mpz_set_str( N, N_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i     );
-    if ( mpz_set_str( d, d_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 1 );
-    if ( mpz_set_str( p, p_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 2 );
-    if ( mpz_set_str( q, q_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 3 );
-    if ( mpz_set_str( d_p, d_p_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 4 );
-    if ( mpz_set_str( d_q, d_q_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 5 );
-    if ( mpz_set_str( i_p, i_p_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 6 );
-    if ( mpz_set_str( i_q, i_q_str, 16 ) == -1 )
-      fprintf( stderr, "failed to parse line %d\n", i + 7 );
-    if ( mpz_set_str( c, c_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 8 );
-      return;
-    }
+const stage_t stage2_def = {
+  sizeof( stage2_challenge_t ), sizeof( stage2_state_t ),
+  _stage2_challenge_init, _stage2_challenge_clear, _stage2_state_init, _stage2_state_clear,
+  _stage2_read, _stage2_compute, _stage2_write, _stage2_compute_run
+};
+
+void _stage2_challenge_init( void * challenge ) {
+  stage2_challenge_t * ch = challenge;
+  mpz_init( ch->N );
+  mpz_init( ch->d );
+  mpz_init( ch->p );
+  mpz_init( ch->q );
+  mpz_init( ch->d_p );
+  mpz_init( ch->d_q );
+  mpz_init( ch->i_p );
+  mpz_init( ch->i_q );
+  mpz_init( ch->c );
+  mpz_init( ch->m );
+  for ( size_t j = 0; j < RSA_OTHERS_MAX; j++ ) {
+    mpz_init( ch->r[j] );
+    mpz_init( ch->d_r[j] );
+    mpz_init( ch->t[j] );
+  }
+}
 
-    // calculate m using RSA decryption with CRT
+void _stage2_challenge_clear( void * challenge ) {
+  stage2_challenge_t * ch = challenge;
+  mpz_clear( ch->N );
+  mpz_clear( ch->d );
+  mpz_clear( ch->p );
+  mpz_clear( ch->q );
+  mpz_clear( ch->d_p );
+  mpz_clear( ch->d_q );
+  mpz_clear( ch->i_p );
+  mpz_clear( ch->i_q );
+  mpz_clear( ch->c );
+  mpz_clear( ch->m );
+  for ( size_t j = 0; j < RSA_OTHERS_MAX; j++ ) {
+    mpz_clear( ch->r[j] );
+    mpz_clear( ch->d_r[j] );
+    mpz_clear( ch->t[j] );
+  }
+}
 
-    mpz_mod( c_p, c, p ); // c_p <- c mod p
-    mpz_mod( c_q, c, q ); // c_q <- c mod q
+// the private key in CRT form, and the params of the primes the worker has seen, which are taken from the cache
+// rather than recomputed when a key repeats
+void _stage2_state_init( void * state ) {
+  stage2_state_t * st = state;
+  rsa_crt_key_init( st->key );
+  mb_ctx_init( st->mb );
+  for ( size_t l = 0; l < MB_LANES; l++ )
+    mpz_init( st->x[l] );
+  modulus_cache_init( st->cache, opt_cache * 1024 );
+  if ( opt_cache > 0 )
+    st->mb->cache = st->cache;
+}
 
-    sliding_window_expm( c_p, c_p, d_p, p ); // c_p' <- c_p^d_p mod p
-    sliding_window_expm( c_q, c_q, d_q, q ); // c_q' <- c_q^d_q mod q
+void _stage2_state_clear( void * state ) {
+  stage2_state_t * st = state;
+  rsa_crt_key_clear( st->key );
+  mb_ctx_clear( st->mb );
+  for ( size_t l = 0; l < MB_LANES; l++ )
+    mpz_clear( st->x[l] );
+  modulus_cache_clear( st->cache );
+}
 
-    mpz_mul( c_p, c_p, q );
-    mpz_mul( c_p, c_p, i_q ); // c_p'' <- c_p' * q * i_q
-    mpz_mul( c_q, c_q, p );
-    mpz_mul( c_q, c_q, i_p ); // c_q'' <- c_q' * p * i_q
+int _stage2_read( void * challenge, hex_reader_t * in ) {
+  stage2_challenge_t * ch = challenge;
+
+  // assign N, d, p, q, d_p, d_q, i_p, i_q, then r_i, d_i and t_i for each prime after q, then c, interpreting input
+  // as hex integer literals
+  mpz_ptr fields[ 9 + 3 * RSA_OTHERS_MAX ] = { ch->N, ch->d, ch->p, ch->q, ch->d_p, ch->d_q, ch->i_p, ch->i_q };
+  size_t  n = 8;
+  for ( size_t j = 0; j + 2 < opt_primes; j++ ) {
+    fields[ n++ ] = ch->r[j];
+    fields[ n++ ] = ch->d_r[j];
+    fields[ n++ ] = ch->t[j];
+  }
+  fields[ n++ ] = ch->c;
+  return _stage_read_fields( in, fields, n );
+}
 
-    mpz_add( m, c_p, c_q );
-    mpz_mod( m, m, N );     // m <- c_p'' * c_q'' mod N TODO: faster to reduce at each stage above
+void _stage2_compute( void * challenge, void * state ) {
+  stage2_challenge_t * ch = challenge;
+  stage2_state_t     * st = state;
 
-    // print c to stdout
-    gmp_printf( "%ZX\n", m );
+  // calculate m using RSA decryption with CRT
+  _stage2_key_set( ch, st );
+  rsa_crt_decrypt( ch->m, ch->c, st->key );
+}
 
-    // incr line counter (we parsed 9 lines from stdin this loop)
-    i += 9;
+// Sets the key of the worker to that of the challenge, with the params of its primes taken from the cache if there
+// is one.
+void _stage2_key_set( stage2_challenge_t * ch, stage2_state_t * st ) {
+  if ( opt_cache > 0 ) {
+    rsa_crt_key_set_cached( st->key, ch->p, ch->q, ch->d_p, ch->d_q, ch->i_q, st->cache );
+    for ( size_t j = 0; j + 2 < opt_primes; j++ )
+      rsa_crt_key_add_prime_cached( st->key, ch->r[j], ch->d_r[j], ch->t[j], st->cache );
+  }
+  else {
+    rsa_crt_key_set( st->key, ch->p, ch->q, ch->d_p, ch->d_q, ch->i_q );
+    for ( size_t j = 0; j + 2 < opt_primes; j++ )
+      rsa_crt_key_add_prime( st->key, ch->r[j], ch->d_r[j], ch->t[j] );
   }
-
-  mpz_clear(N);
-  mpz_clear(d);
-  mpz_clear(p);
-  mpz_clear(q);
-  mpz_clear(d_p);
-  mpz_clear(d_q);
-  mpz_clear(i_p);
-  mpz_clear(i_q);
-  mpz_clear(c);
-  mpz_clear(c_p);
-  mpz_clear(c_q);
-  mpz_clear(m);
-
 }
 
-int _stage2_read_challenge( char ** N_str, char ** d_str, char ** p_str, char ** q_str, char ** d_p_str,
-                             char ** d_q_str, char ** i_p_str, char ** i_q_str, char ** c_str,
-                             size_t * line_size ) {
+// Computes a run of n consecutive challenges. If the CPU has the multi-buffer exponentiation, the CRT halves of
+// MB_LANES / U decryptions at a time are computed together, for keys of U primes, each half in its own lane, and
+// recombined by rsa_crt_recombine as in rsa_crt_decrypt. Otherwise, or with --parallel-crt, which threads the halves
+// of one decryption instead, each decryption is computed by _stage2_compute.
+void _stage2_compute_run( void * challenges, size_t n, void * state ) {
+  stage2_challenge_t * ch = challenges;
+  stage2_state_t     * st = state;
+
+  if ( !mb_available() || opt_parallel_crt ) {
+    for ( size_t i = 0; i < n; i++ )
+      _stage2_compute( &ch[i], state );
+    return;
+  }
+
+  size_t u = opt_primes;
+  for ( size_t i = 0; i < n; i += MB_LANES / u ) {
+    size_t  k = ( n - i < MB_LANES / u ) ? n - i : MB_LANES / u;
+    mpz_ptr x[ u * k ], c[ u * k ], d[ u * k ], P[ u * k ];
+    for ( size_t j = 0; j < k; j++ ) {
+      stage2_challenge_t * ch_j = &ch[ i + j ];
+      for ( size_t l = u * j; l < u * ( j + 1 ); l++ ) {
+        x[l] = st->x[l];
+        c[l] = ch_j->c;
+      }
+      d[ u * j ]     = ch_j->d_p; P[ u * j ]     = ch_j->p;
+      d[ u * j + 1 ] = ch_j->d_q; P[ u * j + 1 ] = ch_j->q;
+      for ( size_t l = 2; l < u; l++ ) {
+        d[ u * j + l ] = ch_j->d_r[ l - 2 ]; P[ u * j + l ] = ch_j->r[ l - 2 ];
+      }
+    }
 
-  int run = 1;
+    // m_p <- c^d_p mod p, m_q <- c^d_q mod q and m_i <- c^d_i mod r_i, c is reduced mod each prime by mb_expm
+    mb_expm( x, c, d, P, u * k, st->mb );
 
-  if ( getline(N_str,   line_size, stdin) == -1 ||
-       getline(d_str,   line_size, stdin) == -1 ||
-       getline(p_str,   line_size, stdin) == -1 ||
-       getline(q_str,   line_size, stdin) == -1 ||
-       getline(d_p_str, line_size, stdin) == -1 ||
-       getline(d_q_str, line_size, stdin) == -1 ||
-       getline(i_p_str, line_size, stdin) == -1 ||
-       getline(i_q_str, line_size, stdin) == -1 ||
-       getline(c_str,   line_size, stdin) == -1
-  ) {
-    run = 0;
+    for ( size_t j = 0; j < k; j++ ) {
+      _stage2_key_set( &ch[ i + j ], st );
+      rsa_crt_recombine( ch[ i + j ].m, x[ u * j ], x[ u * j + 1 ], &x[ u * j + 2 ], st->key );
+    }
   }
+}
+
+void _stage2_write( void * challenge, hex_writer_t * out ) {
+  stage2_challenge_t * ch = challenge;
 
-  return run;
+  // print m to stdout
+  hex_writer_put( out, ch->m );
 }
 
+
 /* Perform stage 3:
  *
  * - read each 5-tuple of p, q, g, h and m from stdin,
@@ -214,116 +284,112 @@ int _stage2_read_challenge( char ** N_str, char ** d_str, char ** p_str, char **
  */
 
 void stage3() {
+  if ( opt_precompute > 0 )
+    elgamal_precomp_init( stage3_precomp, opt_precompute );
 
-  // read each 5-tuple of p, q, g, h and m from stdin
-  // 1024-bit line + terminator
-  char * p_str = NULL;
-  char * q_str = NULL;
-  char * g_str = NULL;
-  char * h_str = NULL;
-  char * m_str = NULL;
-  size_t line_size;
-
-  // init mpz_t's for N, e, m
-  mpz_t p, q, g, h, m;
-  mpz_init(p);
-  mpz_init(q);
-  mpz_init(g);
-  mpz_init(h);
-  mpz_init(m);
-
-  // init a rand state
-  gmp_randstate_t state;
-  gmp_randinit_mt( state ); // use Mersenne Twister as a PRNG
-
-  // seed the rand state
-  mpz_t seed;
-  mpz_init( seed );
-  get_random_seed( seed ); // get a seed using /dev/urandom
-  gmp_randseed( state, seed ); // seed the gmp_randstate_t
-
-  // read challenges from stdin forever
-  int i = 0;
-  while (1) {
-    int run = _stage3_read_challenge( &p_str, &q_str, &g_str, &h_str, &m_str, &line_size );
-    if (!run) return; // no more challenges
-
-    // assign p, q, g, h, m interpreting input as hex integer literals
-    if ( mpz_set_str( p, p_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i     );
-      return;
-    }
-    if ( mpz_set_str( q, q_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 1 );
-      return;
-    }
-    if ( mpz_set_str( g, g_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 2 );
-      return;
-    }
-    if ( mpz_set_str( h, h_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 3 );
-      return;
-    }
-    if ( mpz_set_str( m, m_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 4 );
-      return;
-    }
+  stage_run( &stage3_def );
 
-    // init mpz_t's for ciphertext c
-    mpz_t c1, c2;
-    mpz_init( c1 );
-    mpz_init( c2 );
+  if ( opt_precompute > 0 )
+    elgamal_precomp_clear( stage3_precomp );
+}
 
-    // choose ephermal key k = [0..q-1]
-    mpz_t k;
-    mpz_init( k );
-    mpz_urandomm(k, state, q);
-    //mpz_set_ui( k, 1 );
+const stage_t stage3_def = {
+  sizeof( stage3_challenge_t ), sizeof( stage3_state_t ),
+  _stage3_challenge_init, _stage3_challenge_clear, _stage3_state_init, _stage3_state_clear,
+  _stage3_read, _stage3_compute, _stage3_write, NULL // no compute_run, each challenge is computed on its own
+};
+
+void _stage3_challenge_init( void * challenge ) {
+  stage3_challenge_t * ch = challenge;
+  mpz_init( ch->p );
+  mpz_init( ch->q );
+  mpz_init( ch->g );
+  mpz_init( ch->h );
+  mpz_init( ch->m );
+  mpz_init( ch->c1 );
+  mpz_init( ch->c2 );
+}
 
-    // calculate c1 using ElGamal: c1 = g^k mod p
-    sliding_window_expm( c1, g, k, p );
+void _stage3_challenge_clear( void * challenge ) {
+  stage3_challenge_t * ch = challenge;
+  mpz_clear( ch->p );
+  mpz_clear( ch->q );
+  mpz_clear( ch->g );
+  mpz_clear( ch->h );
+  mpz_clear( ch->m );
+  mpz_clear( ch->c1 );
+  mpz_clear( ch->c2 );
+}
 
-    // calculate c2 using ElGamal: c2 = m*h^k mod p
-    sliding_window_expm( h, h, k, p ); // h'  <- h^k mod p
-    mpz_mul( c2, m, h );        // c2' <- m*h'
-    mpz_mod( c2, c2, p);        // c2  <- c2' mod p
+void _stage3_state_init( void * state ) {
+  stage3_state_t * st = state;
 
-    // print c to stdout
-    gmp_printf( "%ZX\n", c1 );
-    gmp_printf( "%ZX\n", c2 );
+  // a ChaCha20 CSPRNG, keyed from getrandom, for the ephemeral keys
+  csprng_init( st->rng );
 
-    // clear k
-    mpz_clear( k );
+  // comb tables for the generators g of recently seen groups, and the Montgomery and Barrett params for their p
+  modulus_cache_init( st->cache, opt_cache * 1024 );
 
-    i += 5;
-  }
+  mpz_init( st->k );
+}
+
+void _stage3_state_clear( void * state ) {
+  stage3_state_t * st = state;
+  csprng_clear( st->rng );
+  modulus_cache_clear( st->cache );
+  mpz_clear( st->k );
+}
 
-  mpz_clear(p);
-  mpz_clear(q);
-  mpz_clear(g);
-  mpz_clear(h);
-  mpz_clear(m);
+int _stage3_read( void * challenge, hex_reader_t * in ) {
+  stage3_challenge_t * ch = challenge;
 
+  // assign p, q, g, h, m, interpreting input as hex integer literals
+  mpz_ptr fields[] = { ch->p, ch->q, ch->g, ch->h, ch->m };
+  return _stage_read_fields( in, fields, 5 );
 }
 
-int _stage3_read_challenge( char ** p_str, char ** q_str, char ** g_str, char ** h_str, char ** m_str,
-                            size_t * line_size ) {
+void _stage3_compute( void * challenge, void * state ) {
+  stage3_challenge_t * ch = challenge;
+  stage3_state_t     * st = state;
 
-  int run = 1;
+  // if an ephemeral key was precomputed for this public key, c1 = g^k is ready and h' = h^k is ready in Montgomery
+  // representation, so c2 = m*h' mod p costs one Montgomery multiplication
+  if ( opt_precompute > 0 && elgamal_precomp_take( stage3_precomp, ch->c1, ch->h, ch->p, ch->q, ch->g, ch->h ) ) {
+    modulus_struct * mod = modulus_cache_get( st->cache, ch->p );
+    Z_N_montmul( ch->c2, ch->m, ch->h, modulus_montgomery( st->cache, mod ) );
+    return;
+  }
+
+  // choose ephermal key k = [0..q-1]
+  csprng_urandomm( st->k, st->rng, ch->q );
 
-  if ( getline(p_str,   line_size, stdin) == -1 ||
-       getline(q_str,   line_size, stdin) == -1 ||
-       getline(g_str,   line_size, stdin) == -1 ||
-       getline(h_str,   line_size, stdin) == -1 ||
-       getline(m_str,   line_size, stdin) == -1
-  ) {
-    run = 0;
+  // calculate c1 using ElGamal: c1 = g^k mod p, and h' <- h^k mod p.
+  // if g has a comb table, c1 is cheapest from that, else both powers of k are taken in one pass over k
+  modulus_struct    * mod = modulus_cache_get_base( st->cache, ch->g, ch->p, mpz_sizeinbase( ch->q, 2 ) );
+  fixed_base_struct * fb  = mod->fb;
+  if ( fb->G != NULL ) {
+    fixed_base_expm( ch->c1, st->k, fb );
+    sliding_window_expm_mont( ch->h, ch->h, st->k, fb->ctx );
+  }
+  else {
+    mpz_ptr r[] = { ch->c1, ch->h }, b[] = { fb->g, ch->h };
+    sliding_window_expm_mont_n( r, b, 2, st->k, fb->ctx );
   }
 
-  return run;
+  // calculate c2 using ElGamal: c2 = m*h^k mod p, by Barrett as it is a single product. Its params are set the first
+  // time the group's cache entry is used for this
+  mulm_barrett( ch->c2, ch->m, ch->h, modulus_barrett( st->cache, mod ) ); // c2  <- m*h' mod p
 }
 
+void _stage3_write( void * challenge, hex_writer_t * out ) {
+  stage3_challenge_t * ch = challenge;
+
+  // print c to stdout
+  hex_writer_put( out, ch->c1 );
+  hex_writer_put( out, ch->c2 );
+}
+
+
 
 /* Perform stage 4:
  *
@@ -333,112 +399,358 @@ int _stage3_read_challenge( char ** p_str, char ** q_str, char ** g_str, char **
  */
 
 void stage4() {
+  stage_run( &stage4_def );
+}
 
-  // read each 5-tuple of p, q, g, h and m from stdin
-  // 1024-bit line + terminator
-  char * p_str  = NULL;
-  char * q_str  = NULL;
-  char * g_str  = NULL;
-  char * x_str  = NULL;
-  char * c1_str = NULL;
-  char * c2_str = NULL;
-  size_t line_size;
-
-  // init mpz_t's for p, q, g, x, c1, c2
-  mpz_t p, q, g, x, c1, c2;
-  mpz_init(p);
-  mpz_init(q);
-  mpz_init(g);
-  mpz_init(x);
-  mpz_init(c1);
-  mpz_init(c2);
-
-  // read challenges from stdin forever
-  int i = 0;
-  while (1) {
-    int run = _stage4_read_challenge( &p_str, &q_str, &g_str, &x_str, &c1_str, &c2_str, &line_size );
-    if (!run) return; // no more challenges
-
-    // assign p, q, g, x, c1, c2, interpreting input as hex integer literals
-    if ( mpz_set_str( p, p_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i     );
-      return;
-    }
-    if ( mpz_set_str( q, q_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 1 );
-      return;
-    }
-    if ( mpz_set_str( g, g_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 2 );
-      return;
-    }
-    if ( mpz_set_str( x, x_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 3 );
-      return;
-    }
-    if ( mpz_set_str( c1, c1_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 4 );
-      return;
+const stage_t stage4_def = {
+  sizeof( stage4_challenge_t ), sizeof( elgamal_key_t ),
+  _stage4_challenge_init, _stage4_challenge_clear, _stage4_state_init, _stage4_state_clear,
+  _stage4_read, _stage4_compute, _stage4_write, _stage4_compute_run
+};
+
+void _stage4_challenge_init( void * challenge ) {
+  stage4_challenge_t * ch = challenge;
+  mpz_init( ch->p );
+  mpz_init( ch->q );
+  mpz_init( ch->g );
+  mpz_init( ch->x );
+  mpz_init( ch->c1 );
+  mpz_init( ch->c2 );
+  mpz_init( ch->m );
+}
+
+void _stage4_challenge_clear( void * challenge ) {
+  stage4_challenge_t * ch = challenge;
+  mpz_clear( ch->p );
+  mpz_clear( ch->q );
+  mpz_clear( ch->g );
+  mpz_clear( ch->x );
+  mpz_clear( ch->c1 );
+  mpz_clear( ch->c2 );
+  mpz_clear( ch->m );
+}
+
+// the private key, its exponent and Montgomery params are only recomputed when p, q or x change between challenges
+void _stage4_state_init( void * state ) {
+  elgamal_key_init( state );
+}
+
+void _stage4_state_clear( void * state ) {
+  elgamal_key_clear( state );
+}
+
+int _stage4_read( void * challenge, hex_reader_t * in ) {
+  stage4_challenge_t * ch = challenge;
+
+  // assign p, q, g, x, c1, c2, interpreting input as hex integer literals
+  mpz_ptr fields[] = { ch->p, ch->q, ch->g, ch->x, ch->c1, ch->c2 };
+  return _stage_read_fields( in, fields, 6 );
+}
+
+void _stage4_compute( void * challenge, void * state ) {
+  _stage4_compute_run( challenge, 1, state );
+}
+
+// Computes a run of n consecutive challenges, decrypting each run of them that share a private key as one batch.
+void _stage4_compute_run( void * challenges, size_t n, void * state ) {
+  stage4_challenge_t * ch  = challenges;
+  elgamal_key_struct * key = state;
+
+  for ( size_t i = 0, j; i < n; i = j ) {
+    // the challenges i..j-1 share the private key of challenge i
+    for ( j = i + 1; j < n; j++ )
+      if ( mpz_cmp( ch[j].x, ch[i].x ) != 0 || mpz_cmp( ch[j].p, ch[i].p ) != 0 || mpz_cmp( ch[j].q, ch[i].q ) != 0 )
+        break;
+
+    mpz_ptr m[ j - i ], c1[ j - i ], c2[ j - i ];
+    for ( size_t s = i; s < j; s++ ) {
+      m[ s - i ]  = ch[s].m;
+      c1[ s - i ] = ch[s].c1;
+      c2[ s - i ] = ch[s].c2;
     }
-    if ( mpz_set_str( c2, c2_str, 16 ) == -1 ) {
-      fprintf( stderr, "failed to parse line %d\n", i + 5 );
-      return;
+
+    // calculate m using ElGamal: m = c2 * c1^-x
+    elgamal_key_set( key, ch[i].p, ch[i].q, ch[i].x );
+    elgamal_decrypt_batch( m, c1, c2, j - i, key );
+  }
+}
+
+void _stage4_write( void * challenge, hex_writer_t * out ) {
+  stage4_challenge_t * ch = challenge;
+
+  // print m to stdout
+  hex_writer_put( out, ch->m );
+}
+
+
+
+/* Run a stage:
+ *
+ * - read a batch of up to opt_batch challenges from stdin,
+ * - compute them, spread over opt_threads workers, then
+ * - write their results to stdout in input order,
+ *
+ * until the input runs out. With one thread the batch is only bigger than 1 for a stage that computes runs of
+ * challenges together (stage1 and stage2 for the multi-buffer exponentiation, stage4 for batched decryption), else
+ * each challenge is read, computed and written before the next is read; --batch=1 makes that so for every stage.
+ * Either way the output is the same.
+ */
+
+void stage_run( const stage_t * stage ) {
+  size_t threads = ( opt_threads > 1 ) ? opt_threads : 1;
+  size_t batch   = ( ( threads > 1 || stage->compute_run != NULL ) && opt_batch > 1 ) ? opt_batch : 1;
+
+  // the challenges of a batch and the per-worker state, both reused for every batch
+  char * challenges = malloc( batch   * stage->challenge_size );
+  char * states     = malloc( threads * stage->state_size );
+  for ( size_t j = 0; j < batch; j++ )
+    stage->challenge_init( challenges + j * stage->challenge_size );
+  memset( &modulus_cache_totals, 0, sizeof( modulus_cache_totals ) );
+  for ( size_t w = 0; w < threads; w++ )
+    stage->state_init( states + w * stage->state_size );
+
+  thread_pool_t pool;
+  if ( threads > 1 )
+    thread_pool_init( &pool, threads );
+
+  hex_reader_t in;
+  hex_reader_init( &in, stdin );
+  hex_writer_t out;
+  hex_writer_init( &out, stdout );
+
+  int run = 1;
+  while ( run ) {
+    // read challenges from stdin until the batch is full or there are no more challenges
+    size_t n = 0;
+    while ( n < batch && ( run = stage->read( challenges + n * stage->challenge_size, &in ) ) )
+      n++;
+
+    stage_batch_t job = { stage, challenges, states, n, 0 };
+    if ( threads > 1 )
+      thread_pool_run( &pool, _stage_batch_run, &job );
+    else
+      _stage_batch_run( &job, 0 );
+
+    for ( size_t j = 0; j < n; j++ )
+      stage->write( challenges + j * stage->challenge_size, &out );
+    if ( out.tty )
+      hex_writer_flush( &out ); // someone is watching, so don't hold results back until the buffer is full
+  }
+
+  if ( threads > 1 )
+    thread_pool_clear( &pool );
+  for ( size_t j = 0; j < batch; j++ )
+    stage->challenge_clear( challenges + j * stage->challenge_size );
+  for ( size_t w = 0; w < threads; w++ )
+    stage->state_clear( states + w * stage->state_size );
+  if ( opt_cache_stats )
+    fprintf( stderr, "modulus cache: %lu hits, %lu misses, %lu evictions\n", modulus_cache_totals.hits,
+             modulus_cache_totals.misses, modulus_cache_totals.evictions );
+  free( challenges );
+  free( states );
+  hex_reader_clear( &in );
+  hex_writer_flush( &out );
+  hex_writer_clear( &out );
+}
+
+// Reads the next n lines from in into fields, as hex integer literals. Used by the read callback of every stage.
+// @return 1 if all n were read, 0 at the end of the input or if a line fails to parse
+int _stage_read_fields( hex_reader_t * in, mpz_ptr * fields, int n ) {
+  for ( int f = 0; f < n; f++ ) {
+    int r = hex_reader_next( in, fields[f] );
+    if ( r == 0 )
+      return 0; // no more challenges
+    if ( r == -1 ) {
+      fprintf( stderr, "failed to parse line %d\n", in->line - 1 );
+      return 0;
     }
+  }
+  return 1;
+}
 
-    // init mpz_t of decrypted plaintext m
-    mpz_t m;
-    mpz_init( m );
+// Computes the challenges of a batch on one worker, taking the next uncomputed challenge until there are none left.
+void _stage_batch_run( void * batch, size_t worker ) {
+  stage_batch_t * job   = batch;
+  void          * state = job->states + worker * job->stage->state_size;
+
+  // a stage that can compute runs of challenges is handed up to STAGE_RUN_SIZE at a time
+  size_t take = ( job->stage->compute_run != NULL ) ? STAGE_RUN_SIZE : 1;
+
+  size_t j;
+  while ( ( j = __atomic_fetch_add( &job->next, take, __ATOMIC_RELAXED ) ) < job->n ) {
+    size_t n = ( job->n - j < take ) ? job->n - j : take;
+    if ( job->stage->compute_run != NULL )
+      job->stage->compute_run( job->challenges + j * job->stage->challenge_size, n, state );
+    else
+      job->stage->compute( job->challenges + j * job->stage->challenge_size, state );
+  }
+}
 
-    // calculate m using ElGamal: m = c2 * c1^-x
-    // 1. c1 <- c1^-x mod p
-    sliding_window_expm( c1, c1, x, p );
-    mpz_invert( c1, c1, p );
 
-    // 2. m <- c1^-x * c2 mod p
-    mpz_mul( m, c2, c1 );
-    mpz_mod( m,  m, p  );
-    //mulm( m, c2, c1, p ); NOTE this implementation of montgomery multiplication is broken
+//**********************************************************************************************************************
+// Challenge Input and Output                                                                                         **
+//**********************************************************************************************************************
+
+// hex_value[c] is 1 + the value of the hex digit c, or 0 if c is not a hex digit
+const unsigned char hex_value[ 256 ] = {
+  ['0'] =  1, ['1'] =  2, ['2'] =  3, ['3'] =  4, ['4'] =  5, ['5'] =  6, ['6'] =  7, ['7'] =  8,
+  ['8'] =  9, ['9'] = 10, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+                          ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+// Starts reading lines from the stream in, through a single buffer that is refilled in large blocks.
+void hex_reader_init( hex_reader_t * rd, FILE * in ) {
+  rd->in    = in;
+  rd->size  = 1 << 20;
+  rd->buf   = malloc( rd->size );
+  rd->start = 0;
+  rd->end   = 0;
+  rd->eof   = 0;
+  rd->line  = 0;
+}
 
-    // print m to stdout
-    gmp_printf( "%ZX\n", m );
+void hex_reader_clear( hex_reader_t * rd ) {
+  free( rd->buf );
+}
+
+// Finds the next line in the buffer, refilling it from the stream if the line is not all there yet. The line is
+// left in place in the buffer, so is only valid until the next call.
+// @param len set to the length of the line, excluding the terminator
+// @return    the start of the line, or NULL at the end of the input
+char * hex_reader_line( hex_reader_t * rd, size_t * len ) {
+  while ( 1 ) {
+    char * line = rd->buf + rd->start;
+    char * nl   = memchr( line, '\n', rd->end - rd->start );
+
+    if ( nl != NULL || ( rd->eof && rd->start < rd->end ) ) {
+      *len       = ( nl != NULL ) ? nl - line : rd->end - rd->start;
+      rd->start += *len + ( nl != NULL );
+      rd->line++;
+      return line;
+    }
+    if ( rd->eof )
+      return NULL;
+
+    // move the partial line to the front of the buffer, growing it if the partial line already fills it, and refill
+    memmove( rd->buf, line, rd->end - rd->start );
+    rd->end  -= rd->start;
+    rd->start = 0;
+    if ( rd->end == rd->size ) {
+      rd->size *= 2;
+      rd->buf   = realloc( rd->buf, rd->size );
+    }
 
-    i += 6;
+    size_t got = fread( rd->buf + rd->end, 1, rd->size - rd->end, rd->in );
+    rd->end += got;
+    if ( got == 0 )
+      rd->eof = 1;
   }
+}
 
-  mpz_clear(p);
-  mpz_clear(q);
-  mpz_clear(g);
-  mpz_clear(x);
-  mpz_clear(c1);
-  mpz_clear(c2);
+// Reads the next line as a hex integer literal, converting the digits straight into the limbs of r. Leading and
+// trailing whitespace is ignored.
+// @return 1 on success, 0 at the end of the input, or -1 if the line is not a hex integer literal
+int hex_reader_next( hex_reader_t * rd, mpz_t r ) {
+  size_t len;
+  char * line = hex_reader_line( rd, &len );
+  if ( line == NULL )
+    return 0;
+
+  while ( len > 0 && isspace( (unsigned char) line[ len - 1 ] ) )
+    len--;
+  while ( len > 0 && isspace( (unsigned char) line[0] ) ) {
+    line++; len--;
+  }
+  if ( len == 0 )
+    return -1;
+
+  // each limb takes digits_per_limb digits, starting from the least significant end of the line
+  size_t      digits_per_limb = GMP_NUMB_BITS / 4;
+  size_t      l_r             = ( len + digits_per_limb - 1 ) / digits_per_limb;
+  mp_limb_t * r_limbs         = mpz_limbs_write( r, l_r );
+
+  for ( size_t j = 0; j < l_r; j++ ) {
+    size_t    end   = len - j * digits_per_limb;
+    size_t    start = ( end > digits_per_limb ) ? end - digits_per_limb : 0;
+    mp_limb_t limb  = 0;
+
+    for ( size_t d = start; d < end; d++ ) {
+      unsigned char v = hex_value[ (unsigned char) line[d] ];
+      if ( v == 0 ) {
+        mpz_limbs_finish( r, 0 );
+        return -1;
+      }
+      limb = ( limb << 4 ) | ( v - 1 );
+    }
+    r_limbs[j] = limb;
+  }
 
+  mpz_limbs_finish( r, l_r );
+  return 1;
 }
 
-int _stage4_read_challenge( char ** p_str, char ** q_str, char ** g_str, char ** x_str, char ** c1_str,
-                            char ** c2_str, size_t * line_size ) {
+// Starts writing lines to the stream out, through a single buffer that is written out in large blocks.
+void hex_writer_init( hex_writer_t * wr, FILE * out ) {
+  wr->out  = out;
+  wr->size = 1 << 20;
+  wr->buf  = malloc( wr->size );
+  wr->end  = 0;
+  wr->tty  = isatty( fileno( out ) );
+}
 
-  int run = 1;
+// Frees the buffer; anything still in it is lost, so flush first.
+void hex_writer_clear( hex_writer_t * wr ) {
+  free( wr->buf );
+}
 
-  if ( getline(p_str ,   line_size, stdin) == -1 ||
-       getline(q_str ,   line_size, stdin) == -1 ||
-       getline(g_str ,   line_size, stdin) == -1 ||
-       getline(x_str ,   line_size, stdin) == -1 ||
-       getline(c1_str,   line_size, stdin) == -1 ||
-       getline(c2_str,   line_size, stdin) == -1
-  ) {
-    run = 0;
+void hex_writer_flush( hex_writer_t * wr ) {
+  fwrite( wr->buf, 1, wr->end, wr->out );
+  fflush( wr->out );
+  wr->end = 0;
+}
+
+// Appends r as an upper case hex integer literal and a newline, the same as gmp_printf( "%ZX\n", r ) for r >= 0,
+// converting straight from the limbs of r.
+void hex_writer_put( hex_writer_t * wr, const mpz_t r ) {
+  static const char digit[] = "0123456789ABCDEF";
+
+  size_t            digits_per_limb = GMP_NUMB_BITS / 4;
+  size_t            l_r             = mpz_size( r );
+  const mp_limb_t * r_limbs         = mpz_limbs_read( r );
+  size_t            len             = ( l_r == 0 ) ? 1 : ( mpz_sizeinbase( r, 2 ) + 3 ) / 4;
+
+  // make room for the line, growing the buffer if it would not fit even once empty
+  if ( wr->end + len + 1 > wr->size ) {
+    hex_writer_flush( wr );
+    if ( len + 1 > wr->size ) {
+      wr->size = len + 1;
+      wr->buf  = realloc( wr->buf, wr->size );
+    }
   }
 
-  return run;
+  // fill in digits from the least significant end, digits_per_limb per limb
+  char * line = wr->buf + wr->end;
+  size_t d    = len;
+  line[0]     = '0';
+  for ( size_t j = 0; j < l_r; j++ ) {
+    mp_limb_t limb = r_limbs[j];
+    for ( size_t k = 0; k < digits_per_limb && d > 0; k++ ) {
+      line[ --d ] = digit[ limb & 0xF ];
+      limb >>= 4;
+    }
+  }
+  line[ len ] = '\n';
+  wr->end    += len + 1;
 }
 
 
 /*********************************************************************************************************************/
 
-/* Perform stages and optimisations on fixed inputs for testing.
- * This will be piped to a file to compare to Python implementation
- */
-void tests( char * test ) {
+// Runs the named test, or every randomised differential test for "all".
+// @return the number of failed cases
+int tests( char * test ) {
+  int failed = 0;
+
   if ( strcmp( test, "stage1" ) == 0 )
     stage1();
   else if ( strcmp( test, "stage2" ) == 0 )
@@ -448,21 +760,78 @@ void tests( char * test ) {
   else if ( strcmp( test, "stage4" ) == 0 )
     stage4();
   else if ( strcmp( test, "sw" ) == 0 )
-    ;//test_sliding_window();
+    failed = test_run( "sw", test_sliding_window );
+  else if ( strcmp( test, "all" ) == 0 ) {
+    for ( size_t i = 0; test_cases[i].name != NULL; i++ )
+      failed += test_run( test_cases[i].name, test_cases[i].fn );
+  }
   else
     fprintf( stderr, "unrecognised test\n" );
- }
+
+  return failed;
+}
 
 
 /* The main function acts as a driver for the assignment by simply invoking the
- * correct function for the requested stage.
+ * correct function for the requested stage, i.e.
+ *
+ *   ./modmul stageN [options]
+ *
+ * where the options are
+ *
+ *   --parallel-crt  run the CRT halves of each stage2 decryption on a worker per prime
+ *   --primes=U      read stage2 keys of U primes, 2 by default and at most RSA_PRIMES_MAX
+ *   --threads=N     compute challenges on N threads, reading them in batches and writing results in input order
+ *   --batch=N       the number of challenges per batch when using more than one thread, or for stage1, stage2 and
+ *                   stage4 on one thread, 256 by default
+ *   --precompute=D  precompute up to D ephemeral keys per stage3 public key on a background thread
+ *   --no-simd       compute stage1 and stage2 one exponentiation at a time, even if the CPU has AVX-512 IFMA
+ *   --cache=K       keep up to K KiB of params and tables for recently seen moduli per worker, 4096 by default.
+ *                   With 0, stage1 and stage2 recompute them for every challenge and stage3 keeps only the last four
+ *   --cache-stats   report the hits, misses and evictions of those caches on stderr at the end of the stage
+ *
+ * ./modmul test runs randomised differential tests of the primitives against GMP, exiting with 1 if any fail,
+ * and ./modmul bench times the primitives against GMP and writes the results as CSV (see bench_run).
  */
 
 int main( int argc, char* argv[] ) {
-  if( 2 != argc ) {
+  if( 2 > argc ) {
     abort();
   }
 
+  // any further arguments are options
+  for( int i = 2; i < argc; i++ ) {
+    if     ( !strcmp( argv[ i ], "--parallel-crt" ) ) {
+      opt_parallel_crt = 1;
+    }
+    else if( !strcmp( argv[ i ], "--no-simd" ) ) {
+      opt_simd = 0;
+    }
+    else if( !strncmp( argv[ i ], "--threads=", 10 ) ) {
+      opt_threads = strtoul( argv[ i ] + 10, NULL, 10 );
+    }
+    else if( !strncmp( argv[ i ], "--batch=", 8 ) ) {
+      opt_batch = strtoul( argv[ i ] + 8, NULL, 10 );
+    }
+    else if( !strncmp( argv[ i ], "--precompute=", 13 ) ) {
+      opt_precompute = strtoul( argv[ i ] + 13, NULL, 10 );
+    }
+    else if( !strncmp( argv[ i ], "--primes=", 9 ) ) {
+      opt_primes = strtoul( argv[ i ] + 9, NULL, 10 );
+      if ( opt_primes < 2 || opt_primes > RSA_PRIMES_MAX )
+        abort();
+    }
+    else if( !strncmp( argv[ i ], "--cache=", 8 ) ) {
+      opt_cache = strtoul( argv[ i ] + 8, NULL, 10 );
+    }
+    else if( !strcmp( argv[ i ], "--cache-stats" ) ) {
+      opt_cache_stats = 1;
+    }
+    else {
+      abort();
+    }
+  }
+
   if     ( !strcmp( argv[ 1 ], "stage1" ) ) {
     stage1();
   }
@@ -476,7 +845,10 @@ int main( int argc, char* argv[] ) {
     stage4();
   }
   else if( !strcmp( argv[ 1 ], "test"   ) ) {
-    tests( "stage1" );
+    return tests( "all" ) ? 1 : 0;
+  }
+  else if( !strcmp( argv[ 1 ], "bench"  ) ) {
+    bench_run();
   }
   else {
     abort();
@@ -489,134 +861,957 @@ int main( int argc, char* argv[] ) {
 
 
 //**********************************************************************************************************************
-// Cryptographically Secure Random Number Generation                                                                  **
+// Thread Pool                                                                                                        **
 //**********************************************************************************************************************
-void get_random_seed( mpz_t seed ) {
-  // ~bytes of entropy we're trying to achieve (1024-bit, same as p)
-  int byte_count = 1024 / 8;
 
-  // allocate a buffer of this size
-  char data[ byte_count ];
+// Starts a pool of n workers. Worker 0 is whichever thread calls thread_pool_run, so n - 1 threads are created.
+// If a thread cannot be created the pool just has fewer workers.
+void thread_pool_init( thread_pool_t * pool, size_t n ) {
+  pthread_mutex_init( &pool->lock, NULL );
+  pthread_cond_init( &pool->start, NULL );
+  pthread_cond_init( &pool->done, NULL );
+  pool->run     = NULL;
+  pool->arg     = NULL;
+  pool->round   = 0;
+  pool->running = 0;
+  pool->stop    = 0;
+
+  pool->workers = malloc( n * sizeof( thread_pool_worker_t ) );
+  pool->n       = 1;
+  for ( size_t w = 1; w < n; w++ ) {
+    pool->workers[w].pool   = pool;
+    pool->workers[w].worker = w;
+    if ( pthread_create( &pool->workers[w].thread, NULL, _thread_pool_worker, &pool->workers[w] ) != 0 )
+      break;
+    pool->n++;
+  }
+}
+
+// Runs run( arg, w ) on every worker w of the pool, including the calling thread as worker 0, and returns once
+// they have all finished.
+void thread_pool_run( thread_pool_t * pool, void ( * run )( void * arg, size_t worker ), void * arg ) {
+  pthread_mutex_lock( &pool->lock );
+  pool->run     = run;
+  pool->arg     = arg;
+  pool->running = pool->n - 1;
+  pool->round++;
+  pthread_cond_broadcast( &pool->start );
+  pthread_mutex_unlock( &pool->lock );
+
+  run( arg, 0 );
+
+  pthread_mutex_lock( &pool->lock );
+  while ( pool->running > 0 )
+    pthread_cond_wait( &pool->done, &pool->lock );
+  pthread_mutex_unlock( &pool->lock );
+}
+
+void thread_pool_clear( thread_pool_t * pool ) {
+  pthread_mutex_lock( &pool->lock );
+  pool->stop = 1;
+  pthread_cond_broadcast( &pool->start );
+  pthread_mutex_unlock( &pool->lock );
+
+  for ( size_t w = 1; w < pool->n; w++ )
+    pthread_join( pool->workers[w].thread, NULL );
 
-  // read this many bytes from urandom into the buffer
-  FILE *fp;
-  fp = fopen("/dev/urandom", "rb");
-  fread( &data, 1, byte_count, fp );
-  fclose(fp);
+  free( pool->workers );
+  pthread_mutex_destroy( &pool->lock );
+  pthread_cond_destroy( &pool->start );
+  pthread_cond_destroy( &pool->done );
+}
 
-  fprintf( stderr, "rand seed:\n%s\n", data );
+// The body of each pool thread: wait for a new round, run it, report back, until the pool is cleared.
+void * _thread_pool_worker( void * worker ) {
+  thread_pool_worker_t * self = worker;
+  thread_pool_t        * pool = self->pool;
+  unsigned long          seen = 0;
+
+  pthread_mutex_lock( &pool->lock );
+  while ( 1 ) {
+    while ( pool->round == seen && !pool->stop )
+      pthread_cond_wait( &pool->start, &pool->lock );
+    if ( pool->stop )
+      break;
+
+    seen = pool->round;
+    void ( * run )( void *, size_t ) = pool->run;
+    void * arg = pool->arg;
+    pthread_mutex_unlock( &pool->lock );
+
+    run( arg, self->worker );
+
+    pthread_mutex_lock( &pool->lock );
+    if ( --pool->running == 0 )
+      pthread_cond_signal( &pool->done );
+  }
+  pthread_mutex_unlock( &pool->lock );
 
-  // parse the buffer and use this to assign our mpz_t variable
-  //          rop   count       order  size  endian  nails  op
-  mpz_import( seed, byte_count,     1,    1,      0,     0, data );
+  return NULL;
 }
 
 
 //**********************************************************************************************************************
-// Sliding Window Exponentiation                                                                                      **
+// RSA-CRT Decryption                                                                                                 **
 //**********************************************************************************************************************
-const mp_bitcnt_t k = 4; // k <- MAX_SLIDING_WINDOW_SIZE
-const int sw_debug = 0;  // turn on to print verbose info for debugging in sliding window exp functions
+void rsa_crt_key_init( rsa_crt_key_t key ) {
+  mpz_init( key->p );
+  mpz_init( key->q );
+  mpz_init( key->d_p );
+  mpz_init( key->d_q );
+  mpz_init( key->i_q );
+  montgomery_ctx_init( key->own_p_ctx );
+  montgomery_ctx_init( key->own_q_ctx );
+  barrett_ctx_init( key->own_p_barrett );
+  key->p_ctx     = key->own_p_ctx;
+  key->q_ctx     = key->own_q_ctx;
+  key->p_barrett = key->own_p_barrett;
+  key->u         = 2;
+  for ( size_t j = 0; j < RSA_OTHERS_MAX; j++ ) {
+    mpz_init( key->r[j] );
+    mpz_init( key->d_r[j] );
+    mpz_init( key->t[j] );
+    mpz_init( key->R[j] );
+    montgomery_ctx_init( key->own_r_ctx[j] );
+    barrett_ctx_init( key->own_r_barrett[j] );
+    key->r_ctx[j]     = key->own_r_ctx[j];
+    key->r_barrett[j] = key->own_r_barrett[j];
+  }
+  key->pool_n = 0;
+}
 
-// Performs modular exponentiation in the group Z_N.
-// @param r the result an elem of Z_N. r = b^e mod N
-// @param b the base an elem of Z_N
-// @param e the exponenent, an integer
-// @param N the modulus
-void sliding_window_expm( mpz_t r, mpz_t b, mpz_t e, mpz_t N ) {
-  // precompute T = [ b^[j] mod N | j=1,3,..., 2^k - 1 ]
-  size_t table_n = pow( 2, k-1 ); // k-1 because we only need odd elems
-  mpz_t T[table_n];
-  sliding_window_expm_precompute_T( T, table_n, b, N, k );
+// Sets the private key from its CRT components, as a key of two primes.
+// @param i_q q^-1 mod p, the Garner coefficient
+void rsa_crt_key_set( rsa_crt_key_t key, mpz_t p, mpz_t q, mpz_t d_p, mpz_t d_q, mpz_t i_q ) {
+  mpz_set( key->p, p );
+  mpz_set( key->q, q );
+  mpz_set( key->d_p, d_p );
+  mpz_set( key->d_q, d_q );
+  mpz_mod( key->i_q, i_q, p );
+  montgomery_ctx_set( key->own_p_ctx, p );
+  montgomery_ctx_set( key->own_q_ctx, q );
+  barrett_ctx_set( key->own_p_barrett, p );
+  expm_schedule_set( key->own_p_ctx->sched, d_p, sliding_window_size( d_p ) );
+  expm_schedule_set( key->own_q_ctx->sched, d_q, sliding_window_size( d_q ) );
+  key->p_ctx     = key->own_p_ctx;
+  key->q_ctx     = key->own_q_ctx;
+  key->p_barrett = key->own_p_barrett;
+  key->u         = 2;
+}
 
-  // init return value to group identity
-  mpz_set_ui( r, 1 );
+// As rsa_crt_key_set, but takes the params of p and q and the windows of d_p and d_q from cache, computing them only
+// for primes it has not seen recently. The key refers to the cache's entries, so decrypt before the next lookups in
+// cache evict them.
+void rsa_crt_key_set_cached( rsa_crt_key_t key, mpz_t p, mpz_t q, mpz_t d_p, mpz_t d_q, mpz_t i_q,
+                             modulus_cache_struct * cache ) {
+  mpz_set( key->p, p );
+  mpz_set( key->q, q );
+  mpz_set( key->d_p, d_p );
+  mpz_set( key->d_q, d_q );
+  mpz_mod( key->i_q, i_q, p );
+
+  modulus_struct * p_mod = modulus_cache_get( cache, p );
+  modulus_struct * q_mod = modulus_cache_get( cache, q );
+  key->q_ctx     = modulus_montgomery( cache, q_mod );
+  key->p_ctx     = modulus_montgomery( cache, p_mod );
+  key->p_barrett = modulus_barrett( cache, p_mod );
+  modulus_schedule( cache, p_mod, d_p );
+  modulus_schedule( cache, q_mod, d_q );
+  key->u         = 2;
+}
 
-  // init loop vars we will use
-  int         i, // current ix of exponent e we are at
-              l, // ix of last elem in the window
-              u, // the value of the sliding window between indices i and l, i.e. e[i..l]
-              w; // the size of the window
+// Adds the next prime r_i of a multi-prime key, after p, q, ... r_(i-1), as in the otherPrimeInfos of PKCS #1.
+// @param d_r the private exponent mod r - 1
+// @param t   the Garner coefficient ( p * q * ... r_(i-1) )^-1 mod r
+void rsa_crt_key_add_prime( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t ) {
+  size_t j = key->u - 2;
+  _rsa_crt_key_add_prime( key, r, d_r, t );
+  montgomery_ctx_set( key->own_r_ctx[j], r );
+  barrett_ctx_set( key->own_r_barrett[j], r );
+  expm_schedule_set( key->own_r_ctx[j]->sched, d_r, sliding_window_size( d_r ) );
+  key->r_ctx[j]     = key->own_r_ctx[j];
+  key->r_barrett[j] = key->own_r_barrett[j];
+}
 
-  // start of most significant bit of exponent e (when e represented in base-2)
-  size_t tmp = mpz_sizeinbase( e, 2 ) - 1;
-  if (tmp > INT_MAX) fprintf(stderr, "ERROR: sliding_window_expm: mpz_sizeinbase(exponent,2) > INT_MAX\n");
-  i = (int) tmp;
+// As rsa_crt_key_add_prime, but takes the params of r and the windows of d_r from cache. MODULUS_CACHE_KEEP is at
+// least RSA_PRIMES_MAX, so the entries of the earlier primes are not evicted by the lookup of r.
+void rsa_crt_key_add_prime_cached( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t, modulus_cache_struct * cache ) {
+  size_t j = key->u - 2;
+  _rsa_crt_key_add_prime( key, r, d_r, t );
 
-  // we start at i = most signigicant bit of e
-  // l is always a less than or equal sig bit of e
-  // in gmp, e[0] is the least significant bit
+  modulus_struct * mod = modulus_cache_get( cache, r );
+  key->r_ctx[j]     = modulus_montgomery( cache, mod );
+  key->r_barrett[j] = modulus_barrett( cache, mod );
+  modulus_schedule( cache, mod, d_r );
+}
 
-  // keep finding windows until we've gone through all bits of e
-  while (i >= 0) {
+// Sets the components of the next prime r_i of key, and the product R_i = p * q * ... r_(i-1) that Garner's formula
+// scales its correction by.
+void _rsa_crt_key_add_prime( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t ) {
+  if ( key->u == RSA_PRIMES_MAX )
+    abort();
 
-    int sliding = 0;
+  size_t j = key->u++ - 2;
+  mpz_set( key->r[j], r );
+  mpz_set( key->d_r[j], d_r );
+  mpz_mod( key->t[j], t, r );
+  if ( j == 0 )
+    mpz_mul( key->R[j], key->p, key->q );
+  else
+    mpz_mul( key->R[j], key->R[ j - 1 ], key->r[ j - 1 ] );
+}
+
+void rsa_crt_key_clear( rsa_crt_key_t key ) {
+  mpz_clear( key->p );
+  mpz_clear( key->q );
+  mpz_clear( key->d_p );
+  mpz_clear( key->d_q );
+  mpz_clear( key->i_q );
+  montgomery_ctx_clear( key->own_p_ctx );
+  montgomery_ctx_clear( key->own_q_ctx );
+  barrett_ctx_clear( key->own_p_barrett );
+  for ( size_t j = 0; j < RSA_OTHERS_MAX; j++ ) {
+    mpz_clear( key->r[j] );
+    mpz_clear( key->d_r[j] );
+    mpz_clear( key->t[j] );
+    mpz_clear( key->R[j] );
+    montgomery_ctx_clear( key->own_r_ctx[j] );
+    barrett_ctx_clear( key->own_r_barrett[j] );
+  }
+  if ( key->pool_n > 0 )
+    thread_pool_clear( &key->pool );
+}
 
-    // if e[i] is 0, then use a window of size 1 with value 0
-    if ( mpz_tstbit( e, i ) == 0 ) {
-      l = i;
-      u = 0;
+// Computes the RSA decryption m <- c^d mod N using the CRT, recombining the halves with Garner's formula
+//
+//   m = m_q + q * ( ( m_p - m_q ) * q^-1 mod p ),
+//
+// so every product is of half-size values and taken mod p, and no reduction mod N is needed as m < p * q. For a
+// multi-prime key, each prime r_i after q then adds its own half
+//
+//   m = m + R_i * ( ( m_i - m ) * t_i mod r_i ),
+//
+// where R_i = p * q * ... r_(i-1) and t_i = R_i^-1 mod r_i, so m is correct mod R_i * r_i.
+void rsa_crt_decrypt( mpz_t m, mpz_t c, rsa_crt_key_t key ) {
+  size_t n = key->u - 2; // the number of primes after q
+
+  // temporaries come from the pool of the context they are reduced by, so each thread only touches its own pool
+  mpz_ptr m_p, m_q, m_r[ RSA_OTHERS_MAX ];
+  mpz_pool_get( key->p_ctx->pool, &m_p, 1 );
+  mpz_pool_get( key->q_ctx->pool, &m_q, 1 );
+  for ( size_t j = 0; j < n; j++ )
+    mpz_pool_get( key->r_ctx[j]->pool, &m_r[j], 1 );
+
+  mpz_mod( m_p, c, key->p ); // c_p <- c mod p
+  mpz_mod( m_q, c, key->q ); // c_q <- c mod q
+  for ( size_t j = 0; j < n; j++ )
+    mpz_mod( m_r[j], c, key->r[j] ); // c_i <- c mod r_i
+
+  // m_p <- c_p^d_p mod p, m_q <- c_q^d_q mod q and m_i <- c_i^d_i mod r_i. The halves are independent and each has
+  // its own context, so with --parallel-crt they are spread over the key's pool, a worker per prime that is kept
+  // for the next decryption rather than started for each
+  expm_job_t  job[ RSA_PRIMES_MAX ];
+  expm_jobs_t jobs = { job, key->u, 1 };
+  job[0] = ( expm_job_t ) { m_p, m_p, key->p_ctx->sched, key->p_ctx };
+  job[1] = ( expm_job_t ) { m_q, m_q, key->q_ctx->sched, key->q_ctx };
+  for ( size_t j = 0; j < n; j++ )
+    job[ j + 2 ] = ( expm_job_t ) { m_r[j], m_r[j], key->r_ctx[j]->sched, key->r_ctx[j] };
+
+  if ( opt_parallel_crt ) {
+    if ( key->pool_n != key->u ) {
+      if ( key->pool_n > 0 )
+        thread_pool_clear( &key->pool );
+      thread_pool_init( &key->pool, key->u );
+      key->pool_n = key->u;
     }
+    jobs.workers = key->pool.n;
+    thread_pool_run( &key->pool, expm_jobs_run, &jobs );
+  }
+  else
+    expm_jobs_run( &jobs, 0 );
 
-    // else if e[i] is 1, then we want to find a sliding window of size >= 1.
-    else {
-      sliding = 1;
+  rsa_crt_recombine( m, m_p, m_q, m_r, key );
 
-      if (sw_debug) fprintf(stderr, "NEW ITER with window_size>1\ni %d\n", i);
+  for ( size_t j = 0; j < n; j++ )
+    mpz_pool_put( key->r_ctx[j]->pool, 1 );
+  mpz_pool_put( key->q_ctx->pool, 1 );
+  mpz_pool_put( key->p_ctx->pool, 1 );
+}
 
-      // first, set the index of the end of window to the max window size
-      l = ( i > k - 1 ) ? i - (k - 1) : 0;  // max( i-k+1, 0 )
+// Recombines the halves of an RSA-CRT decryption into m, with the formulas of rsa_crt_decrypt. Shared by the
+// multi-buffer path of stage2, which computes the halves of several decryptions together.
+// @param m   the result, c^d mod N
+// @param m_p c^d_p mod p, overwritten
+// @param m_q c^d_q mod q
+// @param m_r c^d_i mod r_i for each prime after q, overwritten
+// @param key the key the halves were computed with
+void rsa_crt_recombine( mpz_t m, mpz_ptr m_p, mpz_ptr m_q, mpz_ptr * m_r, rsa_crt_key_t key ) {
+  // h <- ( m_p - m_q ) * q^-1 mod p, in place of m_p. A single product is cheaper to reduce by Barrett than by
+  // mulm_ctx, which needs two Montgomery multiplications
+  mpz_ptr h = m_p;
+  mpz_sub( h, m_p, m_q );
+  mpz_mod( h, h, key->p );
+  mulm_barrett( h, h, key->i_q, key->p_barrett );
+
+  // m <- m_q + q * h
+  mpz_mul( m, key->q, h );
+  mpz_add( m, m, m_q );
+
+  // m <- m + R_i * ( ( m_i - m ) * t_i mod r_i )
+  for ( size_t j = 0; j + 2 < key->u; j++ ) {
+    mpz_sub( m_r[j], m_r[j], m );
+    mpz_mod( m_r[j], m_r[j], key->r[j] );
+    mulm_barrett( m_r[j], m_r[j], key->t[j], key->r_barrett[j] );
+    mpz_addmul( m, key->R[j], m_r[j] );
+  }
+}
 
-      // next, iterate towards i until we find a 1.
-      // this index will become the end of the window
-      mp_bitcnt_t e_l;
-      while ( l <= i ) {
-        e_l = mpz_tstbit( e, l );
-        if ( e_l == 1 )
-          break;
-        l++;
-      }
-      if (sw_debug) fprintf(stderr, "l %d\n", l);
 
-      // set u <- e[i..l]
-      u = 0;
-      int j = 0;
-      if (sw_debug) fprintf(stderr, "e[i..l] ");
+//**********************************************************************************************************************
+// ElGamal Decryption                                                                                                 **
+//**********************************************************************************************************************
+void elgamal_key_init( elgamal_key_t key ) {
+  mpz_init( key->p );
+  mpz_init( key->q );
+  mpz_init( key->x );
+  mpz_init( key->e );
+  montgomery_ctx_init( key->p_ctx );
+  expm_schedule_init( key->e_sched );
+  expm_schedule_init( key->x_sched );
+}
 
-      for ( int ix = l; ix <= i; ix++ ) {
-        u += (1 << j) * mpz_tstbit( e, (mp_bitcnt_t)ix ); // u_j = 2^j * e[ix]
-        j++;
+// Sets the private key x of the group of order q in Z_p^*. The inverse exponent, the windows of both exponents and the
+// Montgomery params for p are only recomputed if the key differs from the one key already holds.
+void elgamal_key_set( elgamal_key_t key, mpz_t p, mpz_t q, mpz_t x ) {
+  if ( key->e_sched->k != 0 && mpz_cmp( key->x, x ) == 0 && mpz_cmp( key->p, p ) == 0 && mpz_cmp( key->q, q ) == 0 )
+    return;
+
+  mpz_set( key->p, p );
+  mpz_set( key->q, q );
+  mpz_set( key->x, x );
+
+  // e <- -x mod q
+  mpz_sub( key->e, q, x );
+  mpz_mod( key->e, key->e, q );
+
+  expm_schedule_set( key->e_sched, key->e, sliding_window_size( key->e ) );
+  expm_schedule_set( key->x_sched, key->x, sliding_window_size( key->x ) );
+  key->e_cost = expm_schedule_cost( key->e_sched );
+  key->x_cost = expm_schedule_cost( key->x_sched );
+  montgomery_ctx_set( key->p_ctx, p );
+}
 
-        if (sw_debug) fprintf(stderr, "%d", mpz_tstbit(e,(mp_bitcnt_t)ix));
-      }
-      if (sw_debug) fprintf(stderr, "\n");
-      if (sw_debug) fprintf(stderr, "u       %d\n", u);
-    }
+void elgamal_key_clear( elgamal_key_t key ) {
+  mpz_clear( key->p );
+  mpz_clear( key->q );
+  mpz_clear( key->x );
+  mpz_clear( key->e );
+  montgomery_ctx_clear( key->p_ctx );
+  expm_schedule_clear( key->e_sched );
+  expm_schedule_clear( key->x_sched );
+}
 
-    w = (i-l+1);
+// Computes the ElGamal decryption m <- c2 * c1^-x mod p.
+void elgamal_decrypt( mpz_t m, mpz_t c1, mpz_t c2, elgamal_key_t key ) {
+  mpz_ptr m_ptr = m, c1_ptr = c1, c2_ptr = c2;
+  elgamal_decrypt_batch( &m_ptr, &c1_ptr, &c2_ptr, 1, key );
+}
 
-    // now, multiply return value r by 2^(window_size)
-    // r <- r^( 2^(window_size) )
-    for ( int j = 0; j < w; j++ ) {
-      mpz_mul( r, r, r );
-      mpz_mod( r, r, N );
-    }
+// Computes the ElGamal decryptions m[i] <- c2[i] * c1[i]^-x mod p of n ciphertexts under the same key.
+//
+// c1 = g^k is in the subgroup of order q generated by g, so c1^q = 1 and c1^-x = c1^(q-x): the inversion is folded
+// into the exponent rather than costing a mpz_invert per ciphertext, and as q is much shorter than p so is the
+// exponent. The n exponentiations share the exponent, so replay its windows once, and the multiplication by c2 takes
+// the place of the conversion out of Montgomery representation.
+//
+// If x is short enough against e, it is cheaper to compute c1^x and divide by it. The n inversions cost one real
+// inversion and 3(n-1) multiplications with invertm_batch, plus 2 to bring the inverse into Montgomery representation,
+// and the multiplication by c2 is then one more per ciphertext rather than free, so the division is picked when
+//
+//   n * ( cost(e) - cost(x) ) > 4n - 1 + ELGAMAL_INVERT_COST,
+//
+// with the costs of the ladders from expm_schedule_cost.
+// @param m the n results, may alias c1 or c2
+void elgamal_decrypt_batch( mpz_ptr * m, mpz_ptr * c1, mpz_ptr * c2, size_t n, elgamal_key_t key ) {
+  if ( key->e_cost > key->x_cost && n * ( key->e_cost - key->x_cost ) > 4 * n - 1 + ELGAMAL_INVERT_COST &&
+       _elgamal_decrypt_batch_invert( m, c1, c2, n, key ) )
+    return;
+
+  sliding_window_expm_mont_mul_n_sched( m, c1, c2, n, key->e_sched, key->p_ctx );
+}
 
-    // if the value of the window u is nonzero, then add b^(u) to r
-    if ( u != 0 ) {
-      // get the b^(u) using the precomputed table T
-      int ix = ( u - 1 ) / 2;
-      if (sw_debug && sliding == 1) fprintf(stderr, "ix %d\n", ix);
+// Computes m[i] <- c2[i] * ( c1[i]^x )^-1 mod p, for each of the n ciphertexts.
+// @return 1, or 0 if some c1[i]^x is not invertible, in which case m is unchanged
+int _elgamal_decrypt_batch_invert( mpz_ptr * m, mpz_ptr * c1, mpz_ptr * c2, size_t n, elgamal_key_t key ) {
+  montgomery_ctx_struct * ctx = key->p_ctx;
+
+  // s[i] <- c1[i]^x in Montgomery representation, by multiplying the accumulator by one_hat = rho mod p in place of
+  // the conversion out of Montgomery representation
+  mpz_ptr s[ n + 1 ], one_hat[ n ];
+  mpz_pool_get( ctx->pool, s, n + 1 );
+  mpz_set_ui( s[n], 1 );
+  montgomery_to( s[n], s[n], ctx );
+  for ( size_t i = 0; i < n; i++ )
+    one_hat[i] = s[n];
+  sliding_window_expm_mont_mul_n_sched( s, c1, one_hat, n, key->x_sched, ctx );
+
+  // s[i] <- s[i]^-1, then m[i] <- ZN-MontMul(s[i], c2[i]) = c2[i] * ( c1[i]^x )^-1
+  int ok = invertm_batch( s, s, n, ctx );
+  if ( ok )
+    for ( size_t i = 0; i < n; i++ )
+      Z_N_montmul( m[i], s[i], c2[i], ctx );
+
+  mpz_pool_put( ctx->pool, n + 1 );
+  return ok;
+}
 
-      // r <- r * b^(u) mod N
-      mpz_mul( r, r, T[ix] );
-      mpz_mod( r, r, N );
-    }
 
-    // finally, set i to start of next window for the next iter
-    i = l - 1;
-  }
-}
+//**********************************************************************************************************************
+// Benchmarks                                                                                                         **
+//**********************************************************************************************************************
+
+// wall clock time in seconds, for timing benchmarks
+double bench_seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// time stamp counter, for cycle counts. On other architectures there is no cheap equivalent, so cycles are reported
+// as 0
+uint64_t bench_cycles() {
+#if defined( __x86_64__ ) || defined( __i386__ )
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// the primitives, each timed against the GMP equivalent named by ref
+void _bench_gmp_mul_mod( bench_args_t * a ) { mpz_mul( a->r, a->x, a->y ); mpz_mod( a->r, a->r, a->N ); }
+void _bench_mulm( bench_args_t * a )        { mulm( a->r, a->x, a->y, a->N ); }
+void _bench_mulm_ctx( bench_args_t * a )    { mulm_ctx( a->r, a->x, a->y, a->ctx ); }
+void _bench_montmul( bench_args_t * a )     { Z_N_montmul( a->r, a->x, a->y, a->ctx ); }
+void _bench_montsqr( bench_args_t * a )     { Z_N_montsqr( a->r, a->x, a->ctx ); }
+void _bench_gmp_powm( bench_args_t * a )    { mpz_powm( a->r, a->x, a->e, a->N ); }
+void _bench_expm( bench_args_t * a )        { sliding_window_expm( a->r, a->x, a->e, a->N ); }
+void _bench_expm_mont( bench_args_t * a )   { sliding_window_expm_mont( a->r, a->x, a->e, a->ctx ); }
+void _bench_gmp_mod( bench_args_t * a )     { mpz_mod( a->r, a->xy, a->N ); }
+void _bench_barrett( bench_args_t * a )     { barrett_reduce( a->r, a->xy, a->b_ctx ); }
+void _bench_mulm_barrett( bench_args_t * a ) { mulm_barrett( a->r, a->x, a->y, a->b_ctx ); }
+void _bench_sqrm_barrett( bench_args_t * a ) { sqrm_barrett( a->r, a->x, a->b_ctx ); }
+void _bench_expm_barrett( bench_args_t * a ) { sliding_window_expm_barrett( a->r, a->x, a->e, a->b_ctx ); }
+
+// the windows of e found bit by bit, as by the exponentiations before recoding
+void _bench_sliding_window_next( bench_args_t * a ) {
+  mp_bitcnt_t k = sliding_window_size( a->e );
+  int         l;
+  for ( int i = mpz_sizeinbase( a->e, 2 ) - 1; i >= 0; i = l - 1 )
+    sliding_window_next( a->e, i, &l, k );
+}
+
+// a recoding of e into windows, forced as a->sched already holds e
+void _bench_schedule_set( bench_args_t * a ) {
+  a->sched->k = 0;
+  expm_schedule_set( a->sched, a->e, sliding_window_size( a->e ) );
+}
+
+// sliding_window_expm_mont with a new exponent each time, which the schedule of ctx does not hold
+void _bench_expm_mont_recode( bench_args_t * a ) {
+  a->ctx->sched->k = 0;
+  sliding_window_expm_mont( a->r, a->x, a->e, a->ctx );
+}
+
+// a one-off Barrett multiplication, including the setup of mu, to compare with mulm
+void _bench_mulm_barrett_once( bench_args_t * a ) {
+  barrett_ctx_t ctx;
+  barrett_ctx_init( ctx );
+  barrett_ctx_set( ctx, a->N );
+  mulm_barrett( a->r, a->x, a->y, ctx );
+  barrett_ctx_clear( ctx );
+}
+
+const bench_t benches[] = {
+  { "gmp_mod",                     _bench_gmp_mod,             NULL                  },
+  { "barrett_reduce",              _bench_barrett,             "gmp_mod"             },
+  { "gmp_mul_mod",                 _bench_gmp_mul_mod,         NULL                  },
+  { "mulm",                        _bench_mulm,                "gmp_mul_mod"         },
+  { "mulm_barrett_once",           _bench_mulm_barrett_once,   "gmp_mul_mod"         },
+  { "mulm_ctx",                    _bench_mulm_ctx,            "gmp_mul_mod"         },
+  { "mulm_barrett",                _bench_mulm_barrett,        "gmp_mul_mod"         },
+  { "Z_N_montmul",                 _bench_montmul,             "gmp_mul_mod"         },
+  { "Z_N_montsqr",                 _bench_montsqr,             "gmp_mul_mod"         },
+  { "sqrm_barrett",                _bench_sqrm_barrett,        "gmp_mul_mod"         },
+  { "gmp_powm",                    _bench_gmp_powm,            NULL                  },
+  { "sliding_window_expm",         _bench_expm,                "gmp_powm"            },
+  { "sliding_window_expm_mont",    _bench_expm_mont,           "gmp_powm"            },
+  { "expm_mont_recode",            _bench_expm_mont_recode,    "gmp_powm"            },
+  { "sliding_window_expm_barrett", _bench_expm_barrett,        "gmp_powm"            },
+  { "sliding_window_next",         _bench_sliding_window_next, NULL                  },
+  { "expm_schedule_set",           _bench_schedule_set,        "sliding_window_next" }
+};
+
+// Times one primitive: first finds how many ops take about BENCH_RUN_SECONDS, then does one untimed warm-up run
+// and BENCH_REPEATS timed runs of that many ops.
+// @param ns     set to the median time per op over the runs, in ns
+// @param ns_min set to the fastest time per op, in ns
+// @param cycles set to the time stamp counter ticks per op of the median run
+void bench_time( const bench_t * bench, bench_args_t * a, double * ns, double * ns_min, double * cycles ) {
+  size_t ops = 1;
+  while ( 1 ) {
+    double t = bench_seconds();
+    for ( size_t i = 0; i < ops; i++ )
+      bench->fn( a );
+    if ( bench_seconds() - t >= BENCH_RUN_SECONDS / 4 || ops >= ( (size_t) 1 << 30 ) )
+      break;
+    ops *= 2;
+  }
+  ops *= 4;
+
+  double run_ns[ BENCH_REPEATS + 1 ], run_cycles[ BENCH_REPEATS + 1 ];
+  for ( int run = 0; run <= BENCH_REPEATS; run++ ) { // run 0 is the warm-up
+    double   t = bench_seconds();
+    uint64_t c = bench_cycles();
+    for ( size_t i = 0; i < ops; i++ )
+      bench->fn( a );
+    run_cycles[ run ] = (double) ( bench_cycles() - c ) / ops;
+    run_ns[ run ]     = ( bench_seconds() - t ) * 1e9 / ops;
+  }
+
+  // sort the timed runs by time, carrying the cycle counts along, and take the median
+  for ( int i = 2; i <= BENCH_REPEATS; i++ )
+    for ( int j = i; j > 1 && run_ns[ j - 1 ] > run_ns[j]; j-- ) {
+      double t = run_ns[j];     run_ns[j]     = run_ns[ j - 1 ];     run_ns[ j - 1 ]     = t;
+      double c = run_cycles[j]; run_cycles[j] = run_cycles[ j - 1 ]; run_cycles[ j - 1 ] = c;
+    }
+  *ns     = run_ns[ 1 + BENCH_REPEATS / 2 ];
+  *ns_min = run_ns[1];
+  *cycles = run_cycles[ 1 + BENCH_REPEATS / 2 ];
+}
+
+// Times each primitive against GMP for 512 to 4096-bit moduli, writing one CSV row per primitive and size to stdout:
+//
+//   primitive,bits,ns_per_op,ns_per_op_min,cycles_per_op,ops_per_sec,ref,vs_ref
+//
+// where vs_ref is the median time relative to that of the primitive ref, e.g. 0.5 is twice as fast as GMP. The
+// operands are a random odd N with its top bit set, x and y in Z_N and a full length exponent e.
+void bench_run() {
+  const int bits[] = { 512, 1024, 2048, 3072, 4096 };
+  const int n      = sizeof( benches ) / sizeof( benches[0] );
+
+  gmp_randstate_t state;
+  gmp_randinit_default( state );
+
+  bench_args_t a;
+  mpz_init( a.N );
+  mpz_init( a.x );
+  mpz_init( a.y );
+  mpz_init( a.e );
+  mpz_init( a.r );
+  mpz_init( a.xy );
+  montgomery_ctx_init( a.ctx );
+  barrett_ctx_init( a.b_ctx );
+  expm_schedule_init( a.sched );
+
+  printf( "primitive,bits,ns_per_op,ns_per_op_min,cycles_per_op,ops_per_sec,ref,vs_ref\n" );
+
+  for ( int b = 0; b < sizeof( bits ) / sizeof( bits[0] ); b++ ) {
+    mpz_urandomb( a.N, state, bits[b] );
+    mpz_setbit( a.N, bits[b] - 1 );
+    mpz_setbit( a.N, 0 );
+    mpz_urandomm( a.x, state, a.N );
+    mpz_urandomm( a.y, state, a.N );
+    mpz_urandomm( a.e, state, a.N );
+    mpz_mul( a.xy, a.x, a.y );
+    montgomery_ctx_set( a.ctx, a.N );
+    barrett_ctx_set( a.b_ctx, a.N );
+
+    double ns[ n ];
+    for ( int i = 0; i < n; i++ ) {
+      double ns_min, cycles;
+      bench_time( &benches[i], &a, &ns[i], &ns_min, &cycles );
+
+      // the reference is always listed, so timed, before the primitives compared against it
+      double vs_ref = 1;
+      for ( int j = 0; j < i; j++ )
+        if ( benches[i].ref != NULL && !strcmp( benches[j].name, benches[i].ref ) )
+          vs_ref = ns[i] / ns[j];
+
+      printf( "%s,%d,%.1f,%.1f,%.0f,%.0f,%s,%.3f\n", benches[i].name, bits[b], ns[i], ns_min, cycles, 1e9 / ns[i],
+              ( benches[i].ref != NULL ) ? benches[i].ref : benches[i].name, vs_ref );
+      fflush( stdout );
+    }
+  }
+
+  montgomery_ctx_clear( a.ctx );
+  barrett_ctx_clear( a.b_ctx );
+  expm_schedule_clear( a.sched );
+  mpz_clear( a.N );
+  mpz_clear( a.x );
+  mpz_clear( a.y );
+  mpz_clear( a.e );
+  mpz_clear( a.r );
+  mpz_clear( a.xy );
+  gmp_randclear( state );
+}
+
+
+//**********************************************************************************************************************
+// Cryptographically Secure Random Number Generation                                                                  **
+//**********************************************************************************************************************
+// ChaCha20 quarter round on the words a, b, c, d of the state x
+#define CHACHA_QR( x, a, b, c, d )                                                                                    \
+  x[a] += x[b]; x[d] ^= x[a]; x[d] = ( x[d] << 16 ) | ( x[d] >> 16 );                                                 \
+  x[c] += x[d]; x[b] ^= x[c]; x[b] = ( x[b] << 12 ) | ( x[b] >> 20 );                                                 \
+  x[a] += x[b]; x[d] ^= x[a]; x[d] = ( x[d] <<  8 ) | ( x[d] >> 24 );                                                 \
+  x[c] += x[d]; x[b] ^= x[c]; x[b] = ( x[b] <<  7 ) | ( x[b] >> 25 );
+
+// Writes the 64-byte ChaCha20 keystream block for the given key and block counter to out. The nonce is always 0,
+// as each key is only ever used for one refill (see csprng_refill).
+void chacha20_block( unsigned char * out, const uint32_t * key, uint64_t counter ) {
+  uint32_t in[ 16 ] = {
+    0x61707865, 0x3320646E, 0x79622D32, 0x6B206574, // "expand 32-byte k"
+    key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+    (uint32_t) counter, (uint32_t) ( counter >> 32 ), 0, 0
+  };
+  uint32_t x[ 16 ];
+  memcpy( x, in, sizeof( x ) );
+
+  for ( int i = 0; i < 10; i++ ) { // 20 rounds, as 10 column rounds each followed by a diagonal round
+    CHACHA_QR( x, 0, 4,  8, 12 ); CHACHA_QR( x, 1, 5,  9, 13 ); CHACHA_QR( x, 2, 6, 10, 14 ); CHACHA_QR( x, 3, 7, 11, 15 );
+    CHACHA_QR( x, 0, 5, 10, 15 ); CHACHA_QR( x, 1, 6, 11, 12 ); CHACHA_QR( x, 2, 7,  8, 13 ); CHACHA_QR( x, 3, 4,  9, 14 );
+  }
+
+  // serialise x + in little-endian
+  for ( int i = 0; i < 16; i++ ) {
+    uint32_t w = x[i] + in[i];
+    out[ 4 * i + 0 ] = (unsigned char) ( w       );
+    out[ 4 * i + 1 ] = (unsigned char) ( w >>  8 );
+    out[ 4 * i + 2 ] = (unsigned char) ( w >> 16 );
+    out[ 4 * i + 3 ] = (unsigned char) ( w >> 24 );
+  }
+}
+
+// Fills out with n bytes from the kernel's CSPRNG. getrandom blocks only until the kernel pool has been seeded once
+// after boot, and never after. Falls back to /dev/urandom if getrandom is not available.
+void get_random_bytes( unsigned char * out, size_t n ) {
+  while ( n > 0 ) {
+    ssize_t got = getrandom( out, n, 0 );
+    if ( got < 0 ) {
+      if ( errno == EINTR )
+        continue;
+
+      FILE * fp = fopen( "/dev/urandom", "rb" );
+      if ( fp == NULL || fread( out, 1, n, fp ) != n ) {
+        fprintf( stderr, "no source of randomness\n" );
+        abort();
+      }
+      fclose( fp );
+      return;
+    }
+    out += got;
+    n   -= got;
+  }
+}
+
+// Initialises rng with a fresh key from the kernel.
+void csprng_init( csprng_t rng ) {
+  csprng_reseed( rng );
+}
+
+// Wipes the key and any unused output, so they can't be recovered from memory after use.
+void csprng_clear( csprng_t rng ) {
+  volatile unsigned char * p = (volatile unsigned char *) rng;
+  for ( size_t i = 0; i < sizeof( csprng_struct ); i++ )
+    p[i] = 0;
+}
+
+// Replaces the key with a fresh one from the kernel and discards any buffered output.
+void csprng_reseed( csprng_t rng ) {
+  unsigned char seed[ 32 ];
+  get_random_bytes( seed, sizeof( seed ) );
+  for ( int i = 0; i < 8; i++ )
+    rng->key[i] = (uint32_t) seed[ 4 * i ] | (uint32_t) seed[ 4 * i + 1 ] << 8 |
+                  (uint32_t) seed[ 4 * i + 2 ] << 16 | (uint32_t) seed[ 4 * i + 3 ] << 24;
+  memset( seed, 0, sizeof( seed ) );
+
+  rng->pos     = CSPRNG_BUFFER_SIZE; // empty
+  rng->refills = 0;
+}
+
+// Refills the buffer with ChaCha20 keystream. With fast key erasure, the first 32 bytes of each refill become the
+// next key and are wiped from the buffer, so a later compromise of the state does not reveal output already handed
+// out. Every CSPRNG_RESEED_REFILLS refills the key is replaced from the kernel instead.
+void csprng_refill( csprng_t rng ) {
+  if ( ++rng->refills > CSPRNG_RESEED_REFILLS )
+    csprng_reseed( rng );
+
+  for ( size_t i = 0; i < CSPRNG_BUFFER_SIZE / 64; i++ )
+    chacha20_block( rng->buf + 64 * i, rng->key, i );
+
+  for ( int i = 0; i < 8; i++ )
+    rng->key[i] = (uint32_t) rng->buf[ 4 * i ] | (uint32_t) rng->buf[ 4 * i + 1 ] << 8 |
+                  (uint32_t) rng->buf[ 4 * i + 2 ] << 16 | (uint32_t) rng->buf[ 4 * i + 3 ] << 24;
+  memset( rng->buf, 0, 32 );
+  rng->pos = 32;
+}
+
+// Writes n random bytes to out, wiping them from the buffer as they are handed out.
+void csprng_bytes( csprng_t rng, unsigned char * out, size_t n ) {
+  while ( n > 0 ) {
+    if ( rng->pos == CSPRNG_BUFFER_SIZE )
+      csprng_refill( rng );
+
+    size_t take = CSPRNG_BUFFER_SIZE - rng->pos;
+    take = ( take < n ) ? take : n;
+    memcpy( out, rng->buf + rng->pos, take );
+    memset( rng->buf + rng->pos, 0, take );
+    rng->pos += take;
+    out      += take;
+    n        -= take;
+  }
+}
+
+// Samples r uniformly from [0, q-1] by rejection: draw |q| random bits straight into the limbs of r and try again
+// if r >= q. As 2^(|q|-1) <= q, each draw is accepted with probability over 1/2.
+// @param q the bound, q > 0
+void csprng_urandomm( mpz_t r, csprng_t rng, mpz_t q ) {
+  size_t bits = mpz_sizeinbase( q, 2 );
+  size_t l_r  = ( bits + GMP_NUMB_BITS - 1 ) / GMP_NUMB_BITS;
+  size_t top  = bits % GMP_NUMB_BITS; // bits used in the top limb, or 0 if all are
+
+  do {
+    mp_limb_t * r_limbs = mpz_limbs_write( r, l_r );
+    csprng_bytes( rng, (unsigned char *) r_limbs, l_r * sizeof( mp_limb_t ) );
+    if ( top != 0 )
+      r_limbs[ l_r - 1 ] &= ( (mp_limb_t) 1 << top ) - 1;
+    mpz_limbs_finish( r, l_r );
+  } while ( mpz_cmp( r, q ) >= 0 );
+}
+
+
+//**********************************************************************************************************************
+// Sliding Window Exponentiation                                                                                      **
+//**********************************************************************************************************************
+const mp_bitcnt_t k_max = 8; // k_max <- MAX_SLIDING_WINDOW_SIZE
+const int sw_debug = 0;      // turn on to print verbose info for debugging in sliding window exp functions
+
+// Chooses the sliding window size k for the exponent e. A window size of k costs 2^(k-1) table entries up front but
+// saves a multiplication for every window beyond the first, of which there are about |e|/(k+1), so short exponents
+// want small windows and long exponents large ones. The thresholds minimise |e|/(k+1) + 2^(k-1): k beats k-1 once
+// |e|/(k(k+1)) > 2^(k-2), i.e. from 6, 24, 80, 240, 672 and 1792 bits for k = 2 to 7.
+// @param e the exponent
+// @return  k, the max sliding window size to use for e
+mp_bitcnt_t sliding_window_size( mpz_t e ) {
+  size_t bits = mpz_sizeinbase( e, 2 );
+
+  if      ( bits > 1791 ) return 7;
+  else if ( bits >  671 ) return 6;
+  else if ( bits >  239 ) return 5;
+  else if ( bits >   79 ) return 4;
+  else if ( bits >   23 ) return 3;
+  else if ( bits >    5 ) return 2;
+  else                    return 1;
+}
+
+// Performs modular exponentiation in the group Z_N, choosing the window size from the length of e.
+// @param r the result an elem of Z_N. r = b^e mod N
+// @param b the base an elem of Z_N
+// @param e the exponenent, an integer
+// @param N the modulus
+void sliding_window_expm( mpz_t r, mpz_t b, mpz_t e, mpz_t N ) {
+  sliding_window_expm_k( r, b, e, N, sliding_window_size( e ) );
+}
+
+// Performs modular exponentiation in the group Z_N with a given max window size.
+// @param k the max sliding window size, 1 <= k <= k_max
+void sliding_window_expm_k( mpz_t r, mpz_t b, mpz_t e, mpz_t N, mp_bitcnt_t k ) {
+  k = ( k < 1 ) ? 1 : ( k > k_max ) ? k_max : k;
+
+  // precompute T = [ b^[j] mod N | j=1,3,..., 2^k - 1 ]
+  size_t table_n = (size_t) 1 << ( k - 1 ); // k-1 because we only need odd elems
+  mpz_t T[table_n];
+  sliding_window_expm_precompute_T( T, table_n, b, N, k );
+
+  // init return value to group identity
+  mpz_set_ui( r, 1 );
+
+  // init loop vars we will use
+  int         i, // current ix of exponent e we are at
+              l, // ix of last elem in the window
+              u, // the value of the sliding window between indices i and l, i.e. e[i..l]
+              w; // the size of the window
+
+  // start of most significant bit of exponent e (when e represented in base-2)
+  size_t tmp = mpz_sizeinbase( e, 2 ) - 1;
+  if (tmp > INT_MAX) fprintf(stderr, "ERROR: sliding_window_expm: mpz_sizeinbase(exponent,2) > INT_MAX\n");
+  i = (int) tmp;
+
+  // we start at i = most signigicant bit of e
+  // l is always a less than or equal sig bit of e
+  // in gmp, e[0] is the least significant bit
+
+  // keep finding windows until we've gone through all bits of e
+  while (i >= 0) {
+    u = sliding_window_next( e, i, &l, k );
+    w = (i-l+1);
+
+    // now, multiply return value r by 2^(window_size)
+    // r <- r^( 2^(window_size) )
+    for ( int j = 0; j < w; j++ ) {
+      mpz_mul( r, r, r );
+      mpz_mod( r, r, N );
+    }
+
+    // if the value of the window u is nonzero, then add b^(u) to r
+    if ( u != 0 ) {
+      // get the b^(u) using the precomputed table T
+      int ix = ( u - 1 ) / 2;
+      if (sw_debug) fprintf(stderr, "ix %d\n", ix);
+
+      // r <- r * b^(u) mod N
+      mpz_mul( r, r, T[ix] );
+      mpz_mod( r, r, N );
+    }
+
+    // finally, set i to start of next window for the next iter
+    i = l - 1;
+  }
+
+  for ( size_t j = 0; j < table_n; j++ )
+    mpz_clear( T[j] );
+}
+
+
+// Finds the next window of the exponent e, which starts at index i.
+// @param e the exponent
+// @param i the index of the first (most significant) bit of the window
+// @param l set to the index of the last (least significant) bit of the window
+// @param k the max sliding window size
+// @return  u, the value of the window e[i..l]. If e[i] is 0 the window has size 1 and u = 0, else u is odd
+int sliding_window_next( mpz_t e, int i, int * l, mp_bitcnt_t k ) {
+  // if e[i] is 0, then use a window of size 1 with value 0
+  if ( mpz_tstbit( e, i ) == 0 ) {
+    *l = i;
+    return 0;
+  }
+
+  // else if e[i] is 1, then we want to find a sliding window of size >= 1.
+  if (sw_debug) fprintf(stderr, "NEW ITER with window_size>1\ni %d\n", i);
+
+  // first, set the index of the end of window to the max window size
+  *l = ( i > k - 1 ) ? i - (k - 1) : 0;  // max( i-k+1, 0 )
+
+  // next, iterate towards i until we find a 1.
+  // this index will become the end of the window
+  while ( *l <= i ) {
+    if ( mpz_tstbit( e, *l ) == 1 )
+      break;
+    (*l)++;
+  }
+  if (sw_debug) fprintf(stderr, "l %d\n", *l);
+
+  // set u <- e[i..l]
+  int u = 0;
+  int j = 0;
+  if (sw_debug) fprintf(stderr, "e[i..l] ");
+
+  for ( int ix = *l; ix <= i; ix++ ) {
+    u += (1 << j) * mpz_tstbit( e, (mp_bitcnt_t)ix ); // u_j = 2^j * e[ix]
+    j++;
+
+    if (sw_debug) fprintf(stderr, "%d", mpz_tstbit(e,(mp_bitcnt_t)ix));
+  }
+  if (sw_debug) fprintf(stderr, "\n");
+  if (sw_debug) fprintf(stderr, "u       %d\n", u);
+
+  return u;
+}
+
+
+void expm_schedule_init( expm_schedule_t s ) {
+  mpz_init( s->e );
+  s->k     = 0;
+  s->steps = NULL;
+  s->n     = 0;
+  s->size  = 0;
+  s->tail  = 0;
+  s->T_n   = 0;
+}
+
+// Recodes the exponent e into the windows sliding_window_next would find for a max window size of k, unless s
+// already holds them. Each window is read from the limbs of e in one go, and its value and width come from its
+// trailing zeros, so there is no mpz_tstbit per bit. A ladder replaying s then only does its squarings and
+// multiplications, so an exponent used many times, e.g. d_p or x of a private key, is only scanned once.
+// @param e the exponent, a non-negative integer
+// @param k the max sliding window size, 1 <= k <= k_max
+void expm_schedule_set( expm_schedule_t s, mpz_t e, mp_bitcnt_t k ) {
+  k = ( k < 1 ) ? 1 : ( k > k_max ) ? k_max : k;
+  if ( s->k == k && mpz_cmp( s->e, e ) == 0 )
+    return;
+
+  mpz_set( s->e, e );
+  s->k   = k;
+  s->n   = 0;
+  s->T_n = 0;
+
+  const mp_limb_t * e_limbs = mpz_limbs_read( e );
+  size_t            e_n     = mpz_size( e );
+  mp_bitcnt_t       zeros   = 0; // the squarings owed since the last window
+  long              i       = ( e_n == 0 ) ? -1 : (long) mpz_sizeinbase( e, 2 ) - 1;
+
+  while ( i >= 0 ) {
+    if ( _expm_schedule_bits( e_limbs, e_n, i, 1 ) == 0 ) {
+      zeros++;
+      i--;
+      continue;
+    }
+
+    // the window e[i..l] ends at the lowest 1 of the k bits from i down
+    long      lo = ( i >= (long) k - 1 ) ? i - (long) k + 1 : 0;
+    mp_limb_t v  = _expm_schedule_bits( e_limbs, e_n, lo, i - lo + 1 );
+    int       tz = __builtin_ctzll( v );
+
+    if ( s->n == s->size ) {
+      s->size  = ( s->size == 0 ) ? 64 : 2 * s->size;
+      s->steps = realloc( s->steps, s->size * sizeof( expm_step_t ) );
+    }
+    expm_step_t * step = &s->steps[ s->n++ ];
+    step->digit = v >> tz;
+    step->shift = ( s->n == 1 ) ? 0 : zeros + ( i - lo + 1 - tz );
+    if ( step->digit / 2 + 1 > s->T_n )
+      s->T_n = step->digit / 2 + 1;
+
+    zeros = 0;
+    i     = lo + tz - 1;
+  }
+
+  s->tail = zeros;
+}
+
+void expm_schedule_clear( expm_schedule_t s ) {
+  mpz_clear( s->e );
+  free( s->steps );
+}
+
+// @return the cost of a ladder replaying s, in Montgomery multiplications with a squaring counted as one (it costs
+//         about 0.9 of one with the specialised kernels): b^2 and the T_n - 1 products of the table, the squarings of
+//         every step and of the tail, and a multiplication per step after the first
+size_t expm_schedule_cost( expm_schedule_t s ) {
+  size_t cost = s->tail + ( ( s->T_n > 1 ) ? s->T_n : 0 );
+  for ( size_t i = 0; i < s->n; i++ )
+    cost += s->steps[i].shift + ( i > 0 );
+  return cost;
+}
+
+// @return the w < GMP_NUMB_BITS bits of e from bit lo up
+mp_limb_t _expm_schedule_bits( const mp_limb_t * e, size_t e_n, mp_bitcnt_t lo, mp_bitcnt_t w ) {
+  size_t    j = lo / GMP_NUMB_BITS, s = lo % GMP_NUMB_BITS;
+  mp_limb_t v = e[ j ] >> s;
+  if ( s + w > GMP_NUMB_BITS && j + 1 < e_n )
+    v |= e[ j + 1 ] << ( GMP_NUMB_BITS - s );
+  return v & ( ( (mp_limb_t) 1 << w ) - 1 );
+}
 
 
 // precomputes T = [ b^[j] mod N | j=1,3,...,2^k-1 ]
@@ -628,118 +1823,2748 @@ void sliding_window_expm_precompute_T( mpz_t * T, size_t n, mpz_t b, mpz_t N, mp
 
   if (sw_debug) gmp_fprintf(stderr, "T[0]=%Zd\n", T[0]);
 
+  if ( n == 1 )
+    return;
+
+  // b^2 mod N
+  mpz_t b_sqrd;
+  mpz_init( b_sqrd );
+  mpz_mul( b_sqrd, T[0], T[0] );
+  mpz_mod( b_sqrd, b_sqrd, N );
+
   // for a T[i-1]=b^j, then T[i]=b^(j+2)
-  for ( int i = 1; i <= n; i++ ) {
+  for ( int i = 1; i < n; i++ ) {
     // T[i] <- T[i-1] * b^2 mod N
     mpz_init( T[i] );
-    mpz_mul( T[i], b, b );
-    mpz_mul( T[i], T[i], T[i-1] );
+    mpz_mul( T[i], T[i-1], b_sqrd );
     mpz_mod( T[i], T[i], N );
 
     if (sw_debug) gmp_fprintf(stderr, "T[%d]=%Zd\n", i, T[i]);
   }
+
+  mpz_clear( b_sqrd );
+}
+
+
+// Runs the share of worker w of the jobs, i.e. r <- b^e mod N for the exponent e recoded in e of jobs w, w + workers
+// and so on. Has the signature of a thread_pool_run callback, and run as worker 0 of 1 does every job itself.
+void expm_jobs_run( void * jobs, size_t worker ) {
+  expm_jobs_t * j = jobs;
+  for ( size_t i = worker; i < j->n; i += j->workers )
+    sliding_window_expm_mont_sched( j->jobs[i].r, j->jobs[i].b, j->jobs[i].e, j->jobs[i].ctx );
+}
+
+
+// Performs modular exponentiation in the group Z_N, keeping the table T and the accumulator in Montgomery
+// representation for the whole ladder so every squaring and multiply is a Z_N_montmul rather than a mpz_mod.
+// The base is converted into Montgomery representation once, and the result converted back once at the end.
+// The window size is chosen from the length of e.
+// @param r   the result an elem of Z_N. r = b^e mod N
+// @param b   the base, an integer
+// @param e   the exponenent, a non-negative integer
+// @param ctx the Montgomery context for the modulus N
+void sliding_window_expm_mont( mpz_t r, mpz_t b, mpz_t e, montgomery_ctx_t ctx ) {
+  sliding_window_expm_mont_k( r, b, e, ctx, sliding_window_size( e ) );
+}
+
+// As sliding_window_expm_mont, with a given max window size. e is recoded into ctx->sched, which keeps it, so an
+// exponent used again with the same context is not recoded.
+// @param k the max sliding window size, 1 <= k <= k_max
+void sliding_window_expm_mont_k( mpz_t r, mpz_t b, mpz_t e, montgomery_ctx_t ctx, mp_bitcnt_t k ) {
+  expm_schedule_set( ctx->sched, e, k );
+  sliding_window_expm_mont_sched( r, b, ctx->sched, ctx );
+}
+
+// As sliding_window_expm_mont, replaying the windows of an exponent recoded by expm_schedule_set.
+// @param s the recoded exponent, which must not be ctx->sched if e might be recoded meanwhile
+void sliding_window_expm_mont_sched( mpz_t r, mpz_t b, expm_schedule_t s, montgomery_ctx_t ctx ) {
+  if ( s->n == 0 ) {
+    mpz_set_ui( r, 1 );
+    return;
+  }
+
+  // precompute T = [ b_hat^[j] | j=1,3,..., 2 * T_n - 1 ], the odd powers the windows use, followed by the
+  // accumulator r_hat
+  size_t  table_n = s->T_n;
+  mpz_ptr T[ table_n + 1 ];
+  mpz_pool_get( ctx->pool, T, table_n + 1 );
+  sliding_window_expm_mont_precompute_T( T, table_n, b, ctx );
+
+  // the first window starts at the most significant bit of e, which is 1, so rather than squaring the
+  // identity we can start the accumulator at its table entry
+  mpz_ptr r_hat = T[ table_n ];
+  mpz_set( r_hat, T[ s->steps[0].digit / 2 ] );
+
+  for ( size_t j = 1; j < s->n; j++ ) {
+    // r_hat <- r_hat^( 2^shift ) * b_hat^(u)
+    for ( uint32_t q = 0; q < s->steps[j].shift; q++ )
+      Z_N_montsqr( r_hat, r_hat, ctx );
+    Z_N_montmul( r_hat, r_hat, T[ s->steps[j].digit / 2 ], ctx );
+  }
+  for ( mp_bitcnt_t q = 0; q < s->tail; q++ )
+    Z_N_montsqr( r_hat, r_hat, ctx );
+
+  montgomery_from( r, r_hat, ctx );
+
+  mpz_pool_put( ctx->pool, table_n + 1 );
+}
+
+
+// precomputes T = [ b_hat^[j] | j=1,3,...,2^k-1 ], where b_hat is b mod N in Montgomery representation. The
+// entries of T must already be initialised, e.g. taken from ctx->pool.
+void sliding_window_expm_mont_precompute_T( mpz_ptr * T, size_t n, mpz_t b, montgomery_ctx_t ctx ) {
+  // T[0] <- b_hat
+  mpz_mod( T[0], b, ctx->N );
+  montgomery_to( T[0], T[0], ctx );
+
+  if ( n == 1 )
+    return;
+
+  // b_hat^2
+  mpz_ptr b_sqrd;
+  mpz_pool_get( ctx->pool, &b_sqrd, 1 );
+  Z_N_montsqr( b_sqrd, T[0], ctx );
+
+  // T[i] <- T[i-1] * b_hat^2
+  for ( size_t i = 1; i < n; i++ )
+    Z_N_montmul( T[i], T[i-1], b_sqrd, ctx );
+
+  mpz_pool_put( ctx->pool, 1 );
+}
+
+
+//**********************************************************************************************************************
+// Integer Pool                                                                                                       **
+//**********************************************************************************************************************
+void mpz_pool_init( mpz_pool_t pool ) {
+  pool->z    = NULL;
+  pool->n    = 0;
+  pool->used = 0;
+}
+
+void mpz_pool_clear( mpz_pool_t pool ) {
+  for ( size_t i = 0; i < pool->n; i++ ) {
+    mpz_clear( pool->z[i] );
+    free( pool->z[i] );
+  }
+  free( pool->z );
+}
+
+// Lends out n integers, writing them to z. They keep the value and, more to the point, the limbs they had when last
+// put back, so once the pool has warmed up a caller gets integers already grown to the size it needs and no memory is
+// allocated. The pool only grows if more than ever before are lent out at once.
+void mpz_pool_get( mpz_pool_t pool, mpz_ptr * z, size_t n ) {
+  if ( pool->used + n > pool->n ) {
+    size_t grown = pool->used + n;
+    pool->z = realloc( pool->z, grown * sizeof( mpz_ptr ) );
+    for ( size_t i = pool->n; i < grown; i++ ) {
+      pool->z[i] = malloc( sizeof( __mpz_struct ) );
+      mpz_init( pool->z[i] );
+    }
+    pool->n = grown;
+  }
+
+  for ( size_t i = 0; i < n; i++ )
+    z[i] = pool->z[ pool->used + i ];
+  pool->used += n;
+}
+
+// Puts back the last n integers lent out; integers are lent and put back in stack order.
+void mpz_pool_put( mpz_pool_t pool, size_t n ) {
+  pool->used -= n;
 }
 
 
 //**********************************************************************************************************************
 // Montgomery Multiplication                                                                                          **
 //**********************************************************************************************************************
-void mulm( mpz_t r, mpz_t x, mpz_t y, mpz_t N ) {
-  // 1. precompute the Montgomery params omega and rho squared
-  mpz_t omega, rho_sqrd;
-  mpz_init( omega );
-  mpz_init( rho_sqrd );
 
-  mpz_t b;  // the word size i.e. base we are working in
-  mpz_init_set_ui( b, mp_bits_per_limb );
+// Initialises an empty Montgomery context. Call montgomery_ctx_set before use and montgomery_ctx_clear after.
+void montgomery_ctx_init( montgomery_ctx_t ctx ) {
+  mpz_init( ctx->N );
+  mpz_init( ctx->rho_sqrd );
+  ctx->l_N       = 0;
+  ctx->montmul   = Z_N_montmul_limbs;
+  ctx->montsqr   = Z_N_montsqr_limbs;
+  ctx->scratch   = NULL;
+  ctx->windows   = NULL;
+  ctx->windows_n = 0;
+  mpz_pool_init( ctx->pool );
+  expm_schedule_init( ctx->sched );
+}
 
-  // omega
-  mpz_powm_ui( omega, N, (1 << (mp_bits_per_limb-1)) - 1, b ); // NOTE can optimise? mod b is equiv to taking the least significant limb
-  mpz_neg( omega, omega );
-  mpz_add( omega, omega, b ); // omega <- -( N^( 2^( w-1 ) - 1 ) ) mod b
+// Precomputes the Montgomery params for the modulus N and sizes the scratch limbs used by Z_N_montmul.
+// The params are only recomputed if N differs from the modulus ctx already holds, so a batch of challenges
+// sharing N pays the setup cost once.
+// @param N the modulus, must be odd
+void montgomery_ctx_set( montgomery_ctx_t ctx, mpz_t N ) {
+  if ( ctx->l_N != 0 && mpz_cmp( ctx->N, N ) == 0 )
+    return;
 
-  // rho^2
+  mpz_set( ctx->N, N );
   size_t l_N = mpz_size( N );
-  mpz_t exponent, two;
-  mpz_init( exponent );
-  mpz_init_set_ui( two, 2 );
-  mpz_mul_ui( exponent, omega, 2*l_N );
-  mpz_powm( rho_sqrd, two, exponent, N ); // rho^2 <- 2^( 2*l_N*omega ) mod N
-
-  // 2. calculate x_hat and y_hat  (x and y in Montgomery representation) using ZN-MontMul({x,y}_hat, rho^2 mod N)
-  mpz_t x_hat, y_hat;
-  mpz_init( x_hat ); mpz_init( y_hat );
-  size_t omega_N = mpz_size( omega );
-  Z_N_montmul( x_hat, x, rho_sqrd, N, l_N, omega, omega_N );
-  Z_N_montmul( y_hat, y, rho_sqrd, N, l_N, omega, omega_N );
-
-  // 3. calculate r_hat=ZN-MontMul(x_hat,y_hat) (r=x*y in Montgomery representation)
-  mpz_t r_hat;
-  mpz_init( r_hat );
-  Z_N_montmul( r_hat, x_hat, y_hat, N, l_N, omega, omega_N );
-
-  // 4. calculate r=ZN-MontMul(r_hat,1) (r_hat in standard base-b representation)
-  mpz_t unit;
-  mpz_init_set_ui( unit, 1 );
-  Z_N_montmul( r, r_hat, unit, N, l_N, omega, omega_N );
-}
-
-void Z_N_montmul( mpz_t r, mpz_t x, mpz_t y, mpz_t N, size_t l_N, mpz_t omega, size_t omega_N ) {
-  // set r to zero
-  mpz_set_ui( r, 0 );
-
-  //int b = mp_bits_per_limb; // the base we are working in
-
-  // get the limb arrays of x, N, r and omega
-  const mp_limb_t * x_limbs = mpz_limbs_modify( x, l_N );
-  const mp_limb_t * N_limbs = mpz_limbs_modify( N, l_N );
-  const mp_limb_t * r_limbs     = mpz_limbs_modify( r, l_N ); // resize to l_N
-  const mp_limb_t * omega_limbs = mpz_limbs_modify( omega, omega_N );
-
-  // limbs that we need for the calculations in loop body
-  mp_limb_t u_i;
-  mp_limb_t r_0, x_0, y_i;
-
-  // limb arrays that we need for calculations in loop body
-  mp_limb_t tmp0[ 2 + omega_N ];
-  mp_limb_t tmp1[ l_N + 1 ];
-  mp_limb_t tmp2[ l_N + 1 ];
-  mp_limb_t tmp3[ l_N + 1 ];
-  mp_limb_t tmp4[ l_N + 1 ];
+
+  // omega <- -N^-1 mod b. Newton iteration on the least significant limb: each step doubles the number of correct
+  // low bits of the inverse, and N_0 * N_0 = 1 (mod 8) for odd N_0 so we start with 3 correct bits.
+  mp_limb_t N_0 = mpz_getlimbn( N, 0 ), inv = N_0;
+  for ( int bits = 3; bits < mp_bits_per_limb; bits *= 2 )
+    inv *= 2 - N_0 * inv;
+  ctx->omega = -inv;
+
+  // rho^2 <- b^(2*l_N) mod N
+  mpz_set_ui( ctx->rho_sqrd, 0 );
+  mpz_setbit( ctx->rho_sqrd, 2 * l_N * mp_bits_per_limb );
+  mpz_mod( ctx->rho_sqrd, ctx->rho_sqrd, N );
+
+  // scratch holds padded x and y (l_N each) and the scratch of Z_N_montmul_limbs (2 * l_N + 2) or
+  // Z_N_montsqr_limbs (2 * l_N)
+  if ( l_N != ctx->l_N ) {
+    free( ctx->scratch );
+    ctx->scratch = malloc( ( 4 * l_N + 2 ) * sizeof( mp_limb_t ) );
+
+    // the kernels specialised for l_N limbs if there are any, else the generic ones
+    ctx->montmul = Z_N_montmul_limbs;
+    ctx->montsqr = Z_N_montsqr_limbs;
+    for ( size_t i = 0; montgomery_kernels[i].l_N != 0; i++ ) {
+      if ( montgomery_kernels[i].l_N == l_N ) {
+        ctx->montmul = montgomery_kernels[i].montmul;
+        ctx->montsqr = montgomery_kernels[i].montsqr;
+      }
+    }
+  }
+  ctx->l_N = l_N;
+}
+
+void montgomery_ctx_clear( montgomery_ctx_t ctx ) {
+  mpz_clear( ctx->N );
+  mpz_clear( ctx->rho_sqrd );
+  free( ctx->scratch );
+  free( ctx->windows );
+  mpz_pool_clear( ctx->pool );
+  expm_schedule_clear( ctx->sched );
+}
+
+// x_hat <- x * rho mod N, i.e. x in Montgomery representation
+void montgomery_to( mpz_t x_hat, mpz_t x, montgomery_ctx_t ctx ) {
+  Z_N_montmul( x_hat, x, ctx->rho_sqrd, ctx );
+}
+
+// x <- x_hat * rho^-1 mod N, i.e. x_hat back in standard representation
+void montgomery_from( mpz_t x, mpz_t x_hat, montgomery_ctx_t ctx ) {
+  mpz_ptr unit;
+  mpz_pool_get( ctx->pool, &unit, 1 );
+  mpz_set_ui( unit, 1 );
+  Z_N_montmul( x, x_hat, unit, ctx );
+  mpz_pool_put( ctx->pool, 1 );
+}
+
+// Modular multiplication r <- x * y mod N using a precomputed context. Only x is converted to Montgomery
+// representation, since ZN-MontMul(x_hat, y) = x * rho * y * rho^-1 = x * y mod N.
+// @param x, y elems of Z_N
+void mulm_ctx( mpz_t r, mpz_t x, mpz_t y, montgomery_ctx_t ctx ) {
+  mpz_ptr x_hat;
+  mpz_pool_get( ctx->pool, &x_hat, 1 );
+  montgomery_to( x_hat, x, ctx );
+  Z_N_montmul( r, x_hat, y, ctx );
+  mpz_pool_put( ctx->pool, 1 );
+}
+
+// One-off modular multiplication r <- x * y mod N. Prefer mulm_ctx when N is reused.
+void mulm( mpz_t r, mpz_t x, mpz_t y, mpz_t N ) {
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+  montgomery_ctx_set( ctx, N );
+  mulm_ctx( r, x, y, ctx );
+  montgomery_ctx_clear( ctx );
+}
+
+// Computes r <- x * y * rho^-1 mod N following ZN-MontMul from the slides.
+// @param x, y elems of Z_N, r may alias either
+void Z_N_montmul( mpz_t r, mpz_t x, mpz_t y, montgomery_ctx_t ctx ) {
+  size_t      l_N     = ctx->l_N;
+  mp_limb_t * x_limbs = (mp_limb_t *) mpz_limbs_read( x );
+  mp_limb_t * y_limbs = (mp_limb_t *) mpz_limbs_read( y );
+  mp_limb_t * t       = ctx->scratch + 2 * l_N;
+
+  // the kernel wants both operands as full l_N limb arrays, so pad short ones into the scratch limbs
+  size_t x_n = mpz_size( x ), y_n = mpz_size( y );
+  if ( x_n < l_N ) {
+    mpn_copyi( ctx->scratch, x_limbs, x_n ); mpn_zero( ctx->scratch + x_n, l_N - x_n );
+    x_limbs = ctx->scratch;
+  }
+  if ( y_n < l_N ) {
+    mpn_copyi( ctx->scratch + l_N, y_limbs, y_n ); mpn_zero( ctx->scratch + l_N + y_n, l_N - y_n );
+    y_limbs = ctx->scratch + l_N;
+  }
+
+  // if r aliases a short operand, that operand was copied above so r may be reallocated here
+  mp_limb_t * r_limbs = mpz_limbs_write( r, l_N );
+  ctx->montmul( r_limbs, x_limbs, y_limbs, mpz_limbs_read( ctx->N ), l_N, ctx->omega, t );
+  mpz_limbs_finish( r, l_N );
+}
+
+// Limb-level ZN-MontMul (CIOS). Each iteration folds y_i * x and u_i * N into the accumulator with one
+// mpn_addmul_1 each. Rather than dividing the accumulator by b every iteration, the accumulator is a window
+// t[i..i+l_N+1] that slides one limb up the scratch buffer, so the division by b^l_N is free at the end.
+// @param r       the result, l_N limbs, may alias x or y
+// @param x, y    elems of Z_N, l_N limbs each
+// @param N       the modulus, l_N limbs
+// @param omega   -N^-1 mod b
+// @param scratch 2 * l_N + 2 limbs
+void Z_N_montmul_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * y, const mp_limb_t * N,
+                        size_t l_N, mp_limb_t omega, mp_limb_t * scratch ) {
+  mpn_zero( scratch, 2 * l_N + 2 );
 
   for ( size_t i = 0; i < l_N; i++ ) {
-    r_0 = mpz_getlimbn( r, 0 );
-    x_0 = mpz_getlimbn( x, 0 );
-    y_i = mpz_getlimbn( y, i );
+    mp_limb_t * t = scratch + i;
+
+    mp_limb_t c_x = mpn_addmul_1( t, x, l_N, y[ i ] ); // t <- t + (y_i * x)
+    mp_limb_t u_i = t[ 0 ] * omega;                     // u_i <- t_0 * omega (mod b)
+    mp_limb_t c_N = mpn_addmul_1( t, N, l_N, u_i );     // t <- t + (u_i * N), now t_0 = 0
+
+    // fold both carries into the top of the window; t[ l_N + 1 ] has not been touched yet so starts at 0
+    mp_limb_t s = t[ l_N ] + c_x;
+    t[ l_N + 1 ]  = ( s < c_x );
+    t[ l_N ]      = s + c_N;
+    t[ l_N + 1 ] += ( t[ l_N ] < c_N );
+  }
+
+  // the result is the top l_N + 1 limbs, ensure it is in range 0 <= r < N
+  mp_limb_t * t = scratch + l_N;
+  if ( t[ l_N ] != 0 || mpn_cmp( t, N, l_N ) >= 0 )
+    mpn_sub_n( r, t, N, l_N );
+  else
+    mpn_copyi( r, t, l_N );
+}
 
-    // calculate the 'magic' u_i
-    mpn_mul_n( tmp0, &y_i, &x_0, 1 );               //                y_i * x_0
-    mpn_add_n( tmp0, &r_0, tmp0, 2 );               //         r_0 + (y_i * x_0)
-    mpn_mul( tmp0, tmp0, 2, omega_limbs, omega_N ); //        (r_0 + (y_i * x_0)) * omega
-    u_i = tmp0[ 0 ];                                // u_i <- (r_0 + (y_i * x_0)) * omega (mod b), where b is the base
+// Computes r <- x^2 * rho^-1 mod N. Cheaper than Z_N_montmul( r, x, x, ctx ) as the product is a square.
+// @param x an elem of Z_N, r may alias it
+void Z_N_montsqr( mpz_t r, mpz_t x, montgomery_ctx_t ctx ) {
+  size_t      l_N     = ctx->l_N;
+  mp_limb_t * x_limbs = (mp_limb_t *) mpz_limbs_read( x );
 
-    // calculate r at this iter
-    mpn_mul( tmp1, &y_i, 1, x_limbs, l_N );       //           y_i * x
-    mpn_mul( tmp2, &u_i, 1, N_limbs, l_N );       //                       u_i * N
-    mpn_add_n( tmp3,    tmp1, tmp2, l_N + 1 );    //          (y_i * x) + (u_i * N)
-    mpn_add_n( tmp4, r_limbs, tmp3, l_N + 1 );    //      r + (y_i * x) + (u_i * N)
-    shift_limbs_1( r_limbs, tmp4, l_N + 1 );      // r <- r + (y_i * x) + (u_i * N) / b
+  size_t x_n = mpz_size( x );
+  if ( x_n < l_N ) {
+    mpn_copyi( ctx->scratch, x_limbs, x_n ); mpn_zero( ctx->scratch + x_n, l_N - x_n );
+    x_limbs = ctx->scratch;
+  }
+
+  mp_limb_t * r_limbs = mpz_limbs_write( r, l_N );
+  ctx->montsqr( r_limbs, x_limbs, mpz_limbs_read( ctx->N ), l_N, ctx->omega, ctx->scratch + 2 * l_N );
+  mpz_limbs_finish( r, l_N );
+}
+
+// Limb-level Montgomery squaring. The full square is built first with mpn_sqr, which exploits x_i * x_j = x_j * x_i
+// to compute each cross product once and double it, so needs about half the limb products of a multiplication.
+// The square is then reduced by l_N rows of u_i * N, as in ZN-MontMul.
+// @param r       the result, l_N limbs, may alias x
+// @param x       an elem of Z_N, l_N limbs
+// @param N       the modulus, l_N limbs
+// @param omega   -N^-1 mod b
+// @param scratch 2 * l_N limbs
+void Z_N_montsqr_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, size_t l_N, mp_limb_t omega,
+                        mp_limb_t * scratch ) {
+  mp_limb_t * t = scratch;
+
+  // t <- x^2
+  mpn_sqr( t, x, l_N );
+
+  // reduce: t <- t + u_i * N * b^i for each i, zeroing the low l_N limbs. The carry out of row i belongs at
+  // t[i+l_N]; it is parked in the now zero t[i] and all carries are added in one pass at the end
+  for ( size_t i = 0; i < l_N; i++ ) {
+    mp_limb_t u_i = t[ i ] * omega;
+    t[ i ] = mpn_addmul_1( t + i, N, l_N, u_i );
   }
 
   // ensure r is in range 0 <= r < N
-  if ( mpz_cmp( r, N ) >= 0 ) {
-    mpz_sub( r, r, N );
+  mp_limb_t c = mpn_add_n( r, t + l_N, t, l_N );
+  if ( c != 0 || mpn_cmp( r, N, l_N ) >= 0 )
+    mpn_sub_n( r, r, N, l_N );
+}
+
+// Limb-level kernels specialised for L limb moduli, i.e. 512, 1024, 2048 and 4096-bit moduli with 64-bit limbs.
+// With L a constant the operand lengths are fixed and the L rows of the reduction are unrolled into straight-line
+// calls, with no loop counter or length checks. The kernels are compiled at O3 whatever the build, as the unrolling
+// is only done by the optimiser. The product is formed first, as in Z_N_montsqr_limbs, so the multiplication can
+// use mpn_mul_n, which switches to Karatsuba at these sizes, rather than the interleaved rows of CIOS. The inner
+// rows stay as mpn_addmul_1, which GMP implements in assembly for every target. The params are as for
+// Z_N_montmul_limbs and Z_N_montsqr_limbs, but l_N must be L, which montgomery_ctx_set ensures by only picking a
+// kernel for moduli of L limbs, and scratch must be 2 * L limbs.
+#define Z_N_MONT_REDC( r, t, N, L, omega )                                                                           \
+  _Pragma( "GCC unroll 64" )                                                                                         \
+  for ( size_t i = 0; i < L; i++ )                                                                                   \
+    t[ i ] = mpn_addmul_1( t + i, N, L, t[ i ] * omega );                                                            \
+                                                                                                                     \
+  if ( mpn_add_n( r, t + L, t, L ) != 0 || mpn_cmp( r, N, L ) >= 0 )                                                 \
+    mpn_sub_n( r, r, N, L );
+
+#define Z_N_MONT_LIMBS( L )                                                                                          \
+__attribute__(( optimize( "O3" ) ))                                                                                  \
+void Z_N_montmul_limbs_##L( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * y, const mp_limb_t * N,            \
+                            size_t l_N, mp_limb_t omega, mp_limb_t * scratch ) {                                     \
+  ( void ) l_N;                                                                                                      \
+  mp_limb_t * t = scratch;                                                                                           \
+  mpn_mul_n( t, x, y, L );                                                                                           \
+  Z_N_MONT_REDC( r, t, N, L, omega )                                                                                 \
+}                                                                                                                    \
+                                                                                                                     \
+__attribute__(( optimize( "O3" ) ))                                                                                  \
+void Z_N_montsqr_limbs_##L( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, size_t l_N, mp_limb_t omega,    \
+                            mp_limb_t * scratch ) {                                                                  \
+  ( void ) l_N;                                                                                                      \
+  mp_limb_t * t = scratch;                                                                                           \
+  mpn_sqr( t, x, L );                                                                                                \
+  Z_N_MONT_REDC( r, t, N, L, omega )                                                                                 \
+}
+
+Z_N_MONT_LIMBS( 8  )
+Z_N_MONT_LIMBS( 16 )
+Z_N_MONT_LIMBS( 32 )
+Z_N_MONT_LIMBS( 64 )
+
+// the specialised kernels, looked up by montgomery_ctx_set, up to a 0 limb count
+const montgomery_kernel_t montgomery_kernels[] = {
+  { 8,  Z_N_montmul_limbs_8,  Z_N_montsqr_limbs_8  },
+  { 16, Z_N_montmul_limbs_16, Z_N_montsqr_limbs_16 },
+  { 32, Z_N_montmul_limbs_32, Z_N_montsqr_limbs_32 },
+  { 64, Z_N_montmul_limbs_64, Z_N_montsqr_limbs_64 },
+  { 0,  NULL,                 NULL                 }
+};
+
+
+// Inverts n elems of Z_N at once with Montgomery's trick. With the prefix products P_i = x[0] * ... * x[i], one
+// real inversion gives P_(n-1)^-1, and then walking back down
+//
+//   x[i]^-1 = P_(i-1) * P_i^-1 and P_(i-1)^-1 = x[i] * P_i^-1,
+//
+// so the n inverses cost one inversion and 3(n-1) multiplications in total.
+// @param r the n inverses, in Montgomery representation, may alias x
+// @param x the n elems, in Montgomery representation
+// @return  1, or 0 if some x[i] is not invertible, in which case r is unchanged
+int invertm_batch( mpz_ptr * r, mpz_ptr * x, size_t n, montgomery_ctx_t ctx ) {
+  if ( n == 0 )
+    return 1;
+
+  // P[0..n-1] the prefix products, followed by the running inverse t
+  mpz_ptr P[ n + 1 ];
+  mpz_pool_get( ctx->pool, P, n + 1 );
+  mpz_ptr t = P[n];
+
+  mpz_set( P[0], x[0] );
+  for ( size_t i = 1; i < n; i++ )
+    Z_N_montmul( P[i], P[i-1], x[i], ctx );
+
+  // t <- P_(n-1)^-1 in Montgomery representation. P[n-1] is P_(n-1) * rho, so mpz_invert gives P_(n-1)^-1 * rho^-1,
+  // and each multiplication by rho^2 brings in another factor of rho
+  int ok = mpz_invert( t, P[ n - 1 ], ctx->N );
+  if ( ok ) {
+    Z_N_montmul( t, t, ctx->rho_sqrd, ctx );
+    Z_N_montmul( t, t, ctx->rho_sqrd, ctx );
+
+    for ( size_t i = n - 1; i > 0; i-- ) {
+      Z_N_montmul( P[i], t, P[i-1], ctx ); // P[i] is no longer needed, so holds x[i]^-1 until x[i] has been used
+      Z_N_montmul( t, t, x[i], ctx );
+      mpz_swap( r[i], P[i] );
+    }
+    mpz_swap( r[0], t );
+  }
+
+  mpz_pool_put( ctx->pool, n + 1 );
+  return ok;
+}
+
+
+//**********************************************************************************************************************
+// Barrett Reduction                                                                                                  **
+//**********************************************************************************************************************
+void barrett_ctx_init( barrett_ctx_t ctx ) {
+  mpz_init( ctx->N );
+  mpz_init( ctx->mu );
+  ctx->l_N     = 0;
+  ctx->scratch = NULL;
+  mpz_pool_init( ctx->pool );
+}
+
+// Precomputes the Barrett param mu for the modulus N, unless ctx already holds N. Unlike Montgomery multiplication,
+// N need not be odd.
+// @param N the modulus, N > 0
+void barrett_ctx_set( barrett_ctx_t ctx, mpz_t N ) {
+  if ( ctx->l_N != 0 && mpz_cmp( ctx->N, N ) == 0 )
+    return;
+
+  mpz_set( ctx->N, N );
+  size_t l_N = mpz_size( N );
+
+  // mu <- floor( b^(2*l_N) / N ), which has l_N + 1 limbs as b^(l_N-1) <= N < b^l_N, except for N = b^(l_N-1) where
+  // it is b^(l_N+1). barrett_reduce_limbs only reads l_N + 1 limbs, so that mu is capped at b^(l_N+1) - 1
+  mpz_set_ui( ctx->mu, 0 );
+  mpz_setbit( ctx->mu, 2 * l_N * mp_bits_per_limb );
+  mpz_tdiv_q( ctx->mu, ctx->mu, N );
+  if ( mpz_size( ctx->mu ) > l_N + 1 )
+    mpz_sub_ui( ctx->mu, ctx->mu, 1 );
+
+  // scratch holds a product (2 * l_N) and the scratch of barrett_reduce_limbs (4 * l_N + 3)
+  if ( l_N != ctx->l_N ) {
+    free( ctx->scratch );
+    ctx->scratch = malloc( ( 6 * l_N + 3 ) * sizeof( mp_limb_t ) );
   }
+  ctx->l_N = l_N;
+}
+
+void barrett_ctx_clear( barrett_ctx_t ctx ) {
+  mpz_clear( ctx->N );
+  mpz_clear( ctx->mu );
+  free( ctx->scratch );
+  mpz_pool_clear( ctx->pool );
 }
 
-void shift_limbs_1( const mp_limb_t * out, const mp_limb_t * in, size_t N_in ) {
-  // assert N_out == N_in - 1
+// Limb-level Barrett reduction r <- x mod N (HAC 14.42). With k = l_N, the quotient is estimated as
+// q = floor( floor( x / b^(k-1) ) * mu / b^(k+1) ), which is at most 2 less than floor( x / N ), so x - q * N needs
+// at most two subtractions of N. x - q * N < 3N < b^(k+1), so it is computed mod b^(k+1) and only the low k + 1
+// limbs of q * N are needed. For N = b^(k-1) mu is capped one below b^(k+1), which costs at most one more
+// subtraction, as floor( x / b^(k-1) ) < b^(k+1) so q drops by at most 1, and x - q * N < 4N is still below b^(k+1).
+// @param r       the result, l_N limbs, may alias x
+// @param x       2 * l_N limbs
+// @param N       the modulus, l_N limbs
+// @param mu      floor( b^(2*l_N) / N ), capped at b^(l_N+1) - 1, l_N + 1 limbs
+// @param scratch 4 * l_N + 3 limbs
+void barrett_reduce_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, const mp_limb_t * mu,
+                           size_t l_N, mp_limb_t * scratch ) {
+  size_t      k  = l_N;
+  mp_limb_t * q2 = scratch;             // 2k + 2 limbs
+  mp_limb_t * qN = scratch + 2 * k + 2; // 2k + 1 limbs
+
+  // q3 <- floor( q1 * mu / b^(k+1) ), where q1 = floor( x / b^(k-1) )
+  mpn_mul_n( q2, x + k - 1, mu, k + 1 );
+  mp_limb_t * q3 = q2 + k + 1;
+
+  // t <- ( x - q3 * N ) mod b^(k+1), in the low limbs of qN
+  mpn_mul( qN, q3, k + 1, N, k );
+  mpn_sub_n( qN, x, qN, k + 1 );
+
+  while ( qN[ k ] != 0 || mpn_cmp( qN, N, k ) >= 0 )
+    qN[ k ] -= mpn_sub_n( qN, qN, N, k );
+
+  mpn_copyi( r, qN, k );
+}
+
+// Computes r <- x mod N for 0 <= x < b^(2 * l_N), e.g. a product of two elems of Z_N.
+void barrett_reduce( mpz_t r, mpz_t x, barrett_ctx_t ctx ) {
+  size_t      l_N = ctx->l_N, x_n = mpz_size( x );
+  mp_limb_t * t   = ctx->scratch;
+
+  mpn_copyi( t, mpz_limbs_read( x ), x_n );
+  mpn_zero( t + x_n, 2 * l_N - x_n );
+  _barrett_reduce_finish( r, ctx );
+}
 
-  int i = 1; // loop through in
-  int j = 0; // loop through out
+// Computes r <- x * y mod N.
+// @param x, y elems of Z_N, r may alias either
+void mulm_barrett( mpz_t r, mpz_t x, mpz_t y, barrett_ctx_t ctx ) {
+  size_t x_n = mpz_size( x ), y_n = mpz_size( y );
+  if ( x_n == 0 || y_n == 0 ) {
+    mpz_set_ui( r, 0 );
+    return;
+  }
+
+  // the product into the scratch limbs, zero padded to 2 * l_N
+  mp_limb_t * t = ctx->scratch;
+  if ( x_n >= y_n )
+    mpn_mul( t, mpz_limbs_read( x ), x_n, mpz_limbs_read( y ), y_n );
+  else
+    mpn_mul( t, mpz_limbs_read( y ), y_n, mpz_limbs_read( x ), x_n );
+  mpn_zero( t + x_n + y_n, 2 * ctx->l_N - x_n - y_n );
+  _barrett_reduce_finish( r, ctx );
+}
 
-  while ( j < N_in ) {
-    memcpy( (void *) out + j, (void *) in + i, sizeof( mp_limb_t ) );
-    i++; j++;
+// Computes r <- x^2 mod N, with mpn_sqr for the product.
+// @param x an elem of Z_N, r may alias it
+void sqrm_barrett( mpz_t r, mpz_t x, barrett_ctx_t ctx ) {
+  size_t x_n = mpz_size( x );
+  if ( x_n == 0 ) {
+    mpz_set_ui( r, 0 );
+    return;
   }
+
+  mp_limb_t * t = ctx->scratch;
+  mpn_sqr( t, mpz_limbs_read( x ), x_n );
+  mpn_zero( t + 2 * x_n, 2 * ctx->l_N - 2 * x_n );
+  _barrett_reduce_finish( r, ctx );
+}
+
+// r <- the 2 * l_N limb value in the scratch limbs mod N.
+void _barrett_reduce_finish( mpz_t r, barrett_ctx_t ctx ) {
+  size_t      l_N     = ctx->l_N;
+  mp_limb_t * r_limbs = mpz_limbs_write( r, l_N );
+  barrett_reduce_limbs( r_limbs, ctx->scratch, mpz_limbs_read( ctx->N ), mpz_limbs_read( ctx->mu ), l_N,
+                        ctx->scratch + 2 * l_N );
+  mpz_limbs_finish( r, l_N );
+}
+
+// As sliding_window_expm_mont, with Barrett reduction after each product instead of Montgomery multiplication, so
+// there is no conversion in or out and N may be even.
+void sliding_window_expm_barrett( mpz_t r, mpz_t b, mpz_t e, barrett_ctx_t ctx ) {
+  sliding_window_expm_barrett_k( r, b, e, ctx, sliding_window_size( e ) );
+}
+
+// As sliding_window_expm_barrett, with a given max window size.
+// @param k the max sliding window size, 1 <= k <= k_max
+void sliding_window_expm_barrett_k( mpz_t r, mpz_t b, mpz_t e, barrett_ctx_t ctx, mp_bitcnt_t k ) {
+  k = ( k < 1 ) ? 1 : ( k > k_max ) ? k_max : k;
+
+  if ( mpz_sgn( e ) == 0 ) {
+    mpz_set_ui( r, 1 );
+    mpz_mod( r, r, ctx->N );
+    return;
+  }
+
+  // T = [ b^[j] mod N | j=1,3,..., 2^k - 1 ], followed by b^2 and the accumulator
+  size_t  table_n = (size_t) 1 << ( k - 1 );
+  mpz_ptr T[ table_n + 2 ];
+  mpz_pool_get( ctx->pool, T, table_n + 2 );
+  mpz_ptr b_sqrd = T[ table_n ], acc = T[ table_n + 1 ];
+
+  mpz_mod( T[0], b, ctx->N );
+  sqrm_barrett( b_sqrd, T[0], ctx );
+  for ( size_t i = 1; i < table_n; i++ )
+    mulm_barrett( T[i], T[i-1], b_sqrd, ctx );
+
+  int i = (int) mpz_sizeinbase( e, 2 ) - 1, l, u;
+
+  // start the accumulator at the table entry of the first window, as in sliding_window_expm_mont_k
+  u = sliding_window_next( e, i, &l, k );
+  mpz_set( acc, T[ ( u - 1 ) / 2 ] );
+  i = l - 1;
+
+  while ( i >= 0 ) {
+    u = sliding_window_next( e, i, &l, k );
+
+    for ( int j = 0; j < i - l + 1; j++ )
+      sqrm_barrett( acc, acc, ctx );
+    if ( u != 0 )
+      mulm_barrett( acc, acc, T[ ( u - 1 ) / 2 ], ctx );
+
+    i = l - 1;
+  }
+
+  mpz_swap( r, acc );
+  mpz_pool_put( ctx->pool, table_n + 2 );
+}
+
+
+//**********************************************************************************************************************
+// Simultaneous Exponentiation                                                                                        **
+//**********************************************************************************************************************
+
+// Computes r <- prod_i b[i]^e[i] mod N with Straus' method (Shamir's trick, with sliding windows): one accumulator
+// and one squaring chain, |max e[i]| squarings in total, rather than one chain per base.
+// @param r   the result an elem of Z_N
+// @param b   the n bases
+// @param e   the n exponents, non-negative integers
+// @param ctx the Montgomery context for the modulus N
+void multi_expm_mont( mpz_t r, mpz_ptr * b, mpz_ptr * e, size_t n, montgomery_ctx_t ctx ) {
+  size_t bits = 0;
+  for ( size_t i = 0; i < n; i++ )
+    if ( mpz_sizeinbase( e[i], 2 ) > bits )
+      bits = mpz_sizeinbase( e[i], 2 );
+
+  // for each base, the window table and the value of the window ending at each bit of its exponent (or 0). The
+  // tables come from ctx->pool one after another, and the window values live in ctx->windows
+  size_t table_n[ n ], pooled = 0;
+  for ( size_t i = 0; i < n; i++ ) {
+    table_n[i] = (size_t) 1 << ( sliding_window_size( e[i] ) - 1 );
+    pooled    += table_n[i];
+  }
+
+  mpz_ptr   T_all[ pooled + 1 ];
+  mpz_ptr * T[ n ];
+  mpz_pool_get( ctx->pool, T_all, pooled + 1 );
+
+  if ( ctx->windows_n < n * bits ) {
+    free( ctx->windows );
+    ctx->windows_n = n * bits;
+    ctx->windows   = malloc( ctx->windows_n * sizeof( int ) );
+  }
+  int * u = ctx->windows;
+  memset( u, 0, n * bits * sizeof( int ) );
+
+  for ( size_t i = 0, t = 0; i < n; t += table_n[i], i++ ) {
+    mp_bitcnt_t k = sliding_window_size( e[i] );
+    T[i] = T_all + t;
+    sliding_window_expm_mont_precompute_T( T[i], table_n[i], b[i], ctx );
+
+    if ( mpz_sgn( e[i] ) == 0 )
+      continue;
+
+    for ( int j = (int) mpz_sizeinbase( e[i], 2 ) - 1, l; j >= 0; j = l - 1 ) {
+      int w = sliding_window_next( e[i], j, &l, k );
+      if ( w != 0 )
+        u[ i * bits + l ] = w;
+    }
+  }
+
+  // r_hat <- r_hat^2 * prod_i b[i]^(window of e[i] ending at this bit), squaring nothing until the first window
+  mpz_ptr r_hat   = T_all[ pooled ];
+  int     started = 0;
+
+  for ( int j = (int) bits - 1; j >= 0; j-- ) {
+    if ( started )
+      Z_N_montsqr( r_hat, r_hat, ctx );
+
+    for ( size_t i = 0; i < n; i++ ) {
+      int w = u[ i * bits + j ];
+      if ( w == 0 )
+        continue;
+
+      if ( started )
+        Z_N_montmul( r_hat, r_hat, T[i][ ( w - 1 ) / 2 ], ctx );
+      else
+        mpz_set( r_hat, T[i][ ( w - 1 ) / 2 ] );
+      started = 1;
+    }
+  }
+
+  if ( started )
+    montgomery_from( r, r_hat, ctx );
+  else
+    mpz_set_ui( r, 1 ); // every exponent was 0
+
+  mpz_pool_put( ctx->pool, pooled + 1 );
+}
+
+// Computes r[i] <- b[i]^e mod N for each of the n bases, walking the windows of the shared exponent e once and
+// advancing every accumulator in lockstep. Unlike multi_expm_mont each result still needs its own squarings, as the
+// accumulators hold different values, but the window decomposition of e is shared.
+// @param r   the n results, may alias b
+// @param b   the n bases
+// @param e   the exponent, a non-negative integer
+// @param ctx the Montgomery context for the modulus N
+void sliding_window_expm_mont_n( mpz_ptr * r, mpz_ptr * b, size_t n, mpz_t e, montgomery_ctx_t ctx ) {
+  sliding_window_expm_mont_mul_n( r, b, NULL, n, e, ctx, sliding_window_size( e ) );
+}
+
+// As sliding_window_expm_mont_n, but computes r[i] <- b[i]^e * y[i] mod N with a given max window size. The
+// multiplication by y[i] takes the place of the conversion of the result out of Montgomery representation, so is
+// free.
+// @param y the n multipliers, elems of Z_N, or NULL for r[i] <- b[i]^e mod N
+// @param k the max sliding window size, 1 <= k <= k_max
+void sliding_window_expm_mont_mul_n( mpz_ptr * r, mpz_ptr * b, mpz_ptr * y, size_t n, mpz_t e, montgomery_ctx_t ctx,
+                                     mp_bitcnt_t k ) {
+  expm_schedule_set( ctx->sched, e, k );
+  sliding_window_expm_mont_mul_n_sched( r, b, y, n, ctx->sched, ctx );
+}
+
+// As sliding_window_expm_mont_mul_n, replaying the windows of an exponent recoded by expm_schedule_set.
+void sliding_window_expm_mont_mul_n_sched( mpz_ptr * r, mpz_ptr * b, mpz_ptr * y, size_t n, expm_schedule_t s,
+                                           montgomery_ctx_t ctx ) {
+  if ( s->n == 0 ) {
+    for ( size_t i = 0; i < n; i++ ) {
+      if ( y != NULL )
+        mpz_mod( r[i], y[i], ctx->N );
+      else
+        mpz_set_ui( r[i], 1 );
+    }
+    return;
+  }
+
+  // each base's table T[i] is followed by its accumulator T[i][table_n]
+  size_t  table_n = s->T_n;
+  mpz_ptr T[ n ][ table_n + 1 ], r_hat[ n ];
+
+  mpz_pool_get( ctx->pool, T[0], n * ( table_n + 1 ) );
+  for ( size_t i = 0; i < n; i++ ) {
+    sliding_window_expm_mont_precompute_T( T[i], table_n, b[i], ctx );
+    r_hat[i] = T[i][ table_n ];
+  }
+
+  for ( size_t j = 0; j < n; j++ )
+    mpz_set( r_hat[j], T[j][ s->steps[0].digit / 2 ] );
+
+  for ( size_t i = 1; i < s->n; i++ ) {
+    for ( size_t j = 0; j < n; j++ ) {
+      for ( uint32_t q = 0; q < s->steps[i].shift; q++ )
+        Z_N_montsqr( r_hat[j], r_hat[j], ctx );
+      Z_N_montmul( r_hat[j], r_hat[j], T[j][ s->steps[i].digit / 2 ], ctx );
+    }
+  }
+
+  // ZN-MontMul(r_hat, y) = b^e * rho * y * rho^-1 = b^e * y mod N
+  for ( size_t j = 0; j < n; j++ ) {
+    for ( mp_bitcnt_t q = 0; q < s->tail; q++ )
+      Z_N_montsqr( r_hat[j], r_hat[j], ctx );
+    if ( y != NULL )
+      Z_N_montmul( r[j], r_hat[j], y[j], ctx );
+    else
+      montgomery_from( r[j], r_hat[j], ctx );
+  }
+
+  mpz_pool_put( ctx->pool, n * ( table_n + 1 ) );
+}
+
+
+//**********************************************************************************************************************
+// Multi-buffer Exponentiation                                                                                        **
+//**********************************************************************************************************************
+
+// @return 1 if the CPU has AVX-512 IFMA, so mb_expm can run MB_LANES exponentiations at once, and --no-simd is not set
+int mb_available( void ) {
+#if MB_SIMD
+  return opt_simd && __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512ifma" );
+#else
+  return 0;
+#endif
+}
+
+void mb_ctx_init( mb_ctx_t ctx ) {
+  ctx->size  = 0;
+  ctx->N     = NULL;
+  ctx->cache = NULL;
+  mpz_init( ctx->tmp );
+  montgomery_ctx_init( ctx->fallback );
+}
+
+void mb_ctx_clear( mb_ctx_t ctx ) {
+  free( ctx->N );
+  mpz_clear( ctx->tmp );
+  montgomery_ctx_clear( ctx->fallback );
+}
+
+// Sizes the buffers of ctx for moduli of n digits. All of them share one block, aligned for vector loads, which
+// only ever grows.
+void _mb_ctx_size( mb_ctx_t ctx, size_t n ) {
+  if ( n <= ctx->size )
+    return;
+
+  // N, rho^2, T, acc, t and scratch
+  size_t values = 2 + ( 1 << MB_WINDOW_MAX ) + 2;
+  size_t bytes  = ( values * n + 2 * n + 2 ) * MB_LANES * sizeof( uint64_t );
+
+  free( ctx->N );
+  if ( posix_memalign( (void **) &ctx->N, 64, bytes ) != 0 )
+    abort();
+  ctx->rho_sqrd = ctx->N        + n * MB_LANES;
+  ctx->T        = ctx->rho_sqrd + n * MB_LANES;
+  ctx->acc      = ctx->T        + ( 1 << MB_WINDOW_MAX ) * n * MB_LANES;
+  ctx->t        = ctx->acc      + n * MB_LANES;
+  ctx->scratch  = ctx->t        + n * MB_LANES;
+  ctx->size     = n;
+}
+
+// The fixed window size for exponents of the given length, minimising the 2^k - 2 multiplications that build the
+// table plus the one multiplication per window. Unlike a sliding window, every window costs a multiplication, even
+// by T[0] = 1, as all lanes run in lockstep.
+mp_bitcnt_t mb_window_size( mp_bitcnt_t bits ) {
+  mp_bitcnt_t k = 1;
+  for ( mp_bitcnt_t j = 2; j <= MB_WINDOW_MAX; j++ )
+    if ( ( 1UL << j ) - 2 + ( bits + j - 1 ) / j < ( 1UL << k ) - 2 + ( bits + k - 1 ) / k )
+      k = j;
+  return k;
+}
+
+// Computes the params of the odd modulus N for moduli of n digits: k0 <- -N^-1 mod 2^52 and rho^2 mod N, where
+// rho = 2^(52 * n).
+void _mb_params( uint64_t * k0, mpz_t rho_sqrd, mpz_t N, size_t n ) {
+  // Newton iteration, as in montgomery_ctx_set
+  mp_limb_t N_0 = mpz_getlimbn( N, 0 ), inv = N_0;
+  for ( int j = 3; j < MB_DIGIT_BITS; j *= 2 )
+    inv *= 2 - N_0 * inv;
+  *k0 = -inv & MB_DIGIT_MASK;
+
+  mpz_set_ui( rho_sqrd, 0 );
+  mpz_setbit( rho_sqrd, 2 * n * MB_DIGIT_BITS );
+  mpz_mod( rho_sqrd, rho_sqrd, N );
+}
+
+// Sets every lane of x, n digits, to a < 2^52.
+void _mb_set_ui( uint64_t * x, unsigned long a, size_t n ) {
+  for ( size_t j = 0; j < n * MB_LANES; j++ )
+    x[ j ] = ( j < MB_LANES ) ? a : 0;
+}
+
+// Sets lane l of x, n digits, to a, where 0 <= a < 2^(52 * n).
+void _mb_from_mpz( uint64_t * x, size_t l, mpz_t a, size_t n ) {
+  const mp_limb_t * a_limbs = mpz_limbs_read( a );
+  size_t            a_n     = mpz_size( a );
+
+  for ( size_t j = 0; j < n; j++ ) {
+    size_t   bit = j * MB_DIGIT_BITS, i = bit / GMP_NUMB_BITS, s = bit % GMP_NUMB_BITS;
+    uint64_t d   = ( i < a_n ) ? a_limbs[ i ] >> s : 0;
+    if ( s > GMP_NUMB_BITS - MB_DIGIT_BITS && i + 1 < a_n )
+      d |= a_limbs[ i + 1 ] << ( GMP_NUMB_BITS - s );
+    x[ j * MB_LANES + l ] = d & MB_DIGIT_MASK;
+  }
+}
+
+// Sets a to lane l of x, n digits.
+void _mb_to_mpz( mpz_t a, const uint64_t * x, size_t l, size_t n ) {
+  size_t      a_n     = ( n * MB_DIGIT_BITS + GMP_NUMB_BITS - 1 ) / GMP_NUMB_BITS;
+  mp_limb_t * a_limbs = mpz_limbs_write( a, a_n );
+  mpn_zero( a_limbs, a_n );
+
+  for ( size_t j = 0; j < n; j++ ) {
+    size_t   bit = j * MB_DIGIT_BITS, i = bit / GMP_NUMB_BITS, s = bit % GMP_NUMB_BITS;
+    uint64_t d   = x[ j * MB_LANES + l ];
+    a_limbs[ i ] |= d << s;
+    if ( s > GMP_NUMB_BITS - MB_DIGIT_BITS )
+      a_limbs[ i + 1 ] |= d >> ( GMP_NUMB_BITS - s );
+  }
+
+  mpz_limbs_finish( a, a_n );
+}
+
+// r <- T[ w[l] ] in each lane l, for a table of values of n digits.
+void _mb_gather( uint64_t * r, const uint64_t * T, const int * w, size_t n ) {
+  for ( size_t j = 0; j < n; j++ )
+    for ( size_t l = 0; l < MB_LANES; l++ )
+      r[ j * MB_LANES + l ] = T[ ( w[ l ] * n + j ) * MB_LANES + l ];
+}
+
+#if MB_SIMD
+// ZN-MontMul in radix 2^52 in every lane: r <- x * y * 2^(-52 * n) mod N, in CIOS form as Z_N_montmul_limbs.
+// vpmadd52luq and vpmadd52huq add the low and high 52 bits of the products of 52-bit digits to 64-bit accumulators,
+// so the accumulator needs no carry handling inside the loop: a digit gains at most 4 * (n + 1) terms of < 2^52,
+// well short of 2^64. The accumulator is again a window sliding up the scratch digits, with the carry out of the
+// zeroed bottom digit added into the next, and the result is normalised to 52-bit digits once at the end.
+// @param r       the result, n digits, may alias x or y
+// @param x, y    elems of Z_N in every lane, n digits each
+// @param N       the moduli, n digits, with 2^(52 * n) > N
+// @param k0      -N^-1 mod 2^52 for each lane
+// @param scratch 2 * n + 2 digits
+__attribute__(( target( "avx512f,avx512ifma" ), optimize( "O3" ) ))
+void _mb_montmul( uint64_t * r, const uint64_t * x, const uint64_t * y, const uint64_t * N, const uint64_t * k0,
+                  size_t n, uint64_t * scratch ) {
+  const __m512i * X = (const __m512i *) x, * Y = (const __m512i *) y, * M = (const __m512i *) N;
+  __m512i       * R = (__m512i *) r, * t = (__m512i *) scratch;
+
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i mask = _mm512_set1_epi64( MB_DIGIT_MASK );
+  const __m512i K    = _mm512_loadu_si512( k0 );
+
+  for ( size_t j = 0; j < 2 * n + 2; j++ )
+    t[ j ] = zero;
+
+  for ( size_t i = 0; i < n; i++, t++ ) {
+    __m512i y_i = Y[ i ];
+    for ( size_t j = 0; j < n; j++ ) {                               // t <- t + (y_i * x)
+      t[ j ]     = _mm512_madd52lo_epu64( t[ j ],     X[ j ], y_i );
+      t[ j + 1 ] = _mm512_madd52hi_epu64( t[ j + 1 ], X[ j ], y_i );
+    }
+
+    __m512i u_i = _mm512_madd52lo_epu64( zero, t[ 0 ], K );         // u_i <- t_0 * k0 (mod 2^52)
+    for ( size_t j = 0; j < n; j++ ) {                               // t <- t + (u_i * N), now t_0 = 0 (mod 2^52)
+      t[ j ]     = _mm512_madd52lo_epu64( t[ j ],     M[ j ], u_i );
+      t[ j + 1 ] = _mm512_madd52hi_epu64( t[ j + 1 ], M[ j ], u_i );
+    }
+    t[ 1 ] = _mm512_add_epi64( t[ 1 ], _mm512_srli_epi64( t[ 0 ], MB_DIGIT_BITS ) );
+  }
+
+  // the result t[0..n] is < 2N, normalise it to 52-bit digits
+  __m512i c = zero;
+  for ( size_t j = 0; j <= n; j++ ) {
+    __m512i d = _mm512_add_epi64( t[ j ], c );
+    t[ j ] = _mm512_and_si512( d, mask );
+    c      = _mm512_srli_epi64( d, MB_DIGIT_BITS );
+  }
+
+  // D <- t - N in the digits below the window, then r <- D in the lanes where that did not borrow, else t
+  __m512i * D = (__m512i *) scratch;
+  __m512i   b = zero;
+  for ( size_t j = 0; j < n; j++ ) {
+    __m512i d = _mm512_sub_epi64( _mm512_sub_epi64( t[ j ], M[ j ] ), b );
+    D[ j ] = _mm512_and_si512( d, mask );
+    b      = _mm512_srli_epi64( d, 63 );
+  }
+  __mmask8 ge = _mm512_cmpeq_epi64_mask( _mm512_srli_epi64( _mm512_sub_epi64( t[ n ], b ), 63 ), zero );
+  for ( size_t j = 0; j < n; j++ )
+    R[ j ] = _mm512_mask_blend_epi64( ge, t[ j ], D[ j ] );
+}
+#endif
+
+// Computes r[i] <- b[i]^e[i] mod N[i] for i < n <= MB_LANES, with MB_LANES exponentiations running in lockstep, one
+// per vector lane, when the CPU allows it. Each lane has its own modulus and exponent; the moduli should be of
+// about the same length, as every lane is worked at the length of the longest. As the lanes cannot branch apart,
+// this uses a fixed window rather than a sliding one: every k-bit window of the longest exponent costs k squarings
+// and one multiplication by T[w] in each lane, where w is that lane's window. Lanes beyond n repeat lane 0.
+// Otherwise, or for fewer than MB_MIN_LANES exponentiations, each is done by sliding_window_expm_mont.
+// @param b  elems of Z_N, reduced here if need be
+// @param N  odd moduli, N > 1
+// @param r  the results, r[i] may alias b[i], e[i] or N[i]
+void mb_expm( mpz_ptr * r, mpz_ptr * b, mpz_ptr * e, mpz_ptr * N, size_t n, mb_ctx_t ctx ) {
+  size_t      d    = 0; // the number of digits of the longest modulus
+  mp_bitcnt_t bits = 0; // the length of the longest exponent
+  for ( size_t i = 0; i < n; i++ ) {
+    size_t N_bits = mpz_sizeinbase( N[i], 2 );
+    d    = ( N_bits + MB_DIGIT_BITS - 1 ) / MB_DIGIT_BITS > d ? ( N_bits + MB_DIGIT_BITS - 1 ) / MB_DIGIT_BITS : d;
+    bits = ( mpz_sgn( e[i] ) != 0 && mpz_sizeinbase( e[i], 2 ) > bits ) ? mpz_sizeinbase( e[i], 2 ) : bits;
+  }
+
+#if MB_SIMD
+  if ( n >= MB_MIN_LANES && n <= MB_LANES && d * MB_DIGIT_BITS <= MB_MAX_BITS + MB_DIGIT_BITS && mb_available() ) {
+    _mb_ctx_size( ctx, d );
+    mp_bitcnt_t k = mb_window_size( bits );
+
+    for ( size_t l = 0; l < MB_LANES; l++ ) {
+      size_t i = ( l < n ) ? l : 0;
+
+      // k0 and rho^2 as for lane 0 if this lane is spare, from the cache if N[i] was seen before at this length,
+      // else computed afresh
+      _mb_from_mpz( ctx->N, l, N[i], d );
+      if ( l >= n ) {
+        ctx->k0[ l ] = ctx->k0[ 0 ];
+        for ( size_t j = 0; j < d; j++ )
+          ctx->rho_sqrd[ j * MB_LANES + l ] = ctx->rho_sqrd[ j * MB_LANES ];
+      }
+      else if ( ctx->cache != NULL ) {
+        modulus_struct * mod = modulus_cache_get( ctx->cache, N[i] );
+        modulus_mb_params( ctx->cache, mod, d );
+        ctx->k0[ l ] = mod->mb_k0;
+        _mb_from_mpz( ctx->rho_sqrd, l, mod->mb_rho_sqrd, d );
+      }
+      else {
+        _mb_params( &ctx->k0[ l ], ctx->tmp, N[i], d );
+        _mb_from_mpz( ctx->rho_sqrd, l, ctx->tmp, d );
+      }
+
+      mpz_mod( ctx->tmp, b[i], N[i] );
+      _mb_from_mpz( ctx->t, l, ctx->tmp, d );
+    }
+
+    // T[0] <- 1 and T[1] <- b, in Montgomery representation, then T[w] <- T[w-1] * b
+    size_t    v = d * MB_LANES;
+    uint64_t * T = ctx->T;
+    _mb_montmul( T + v, ctx->t, ctx->rho_sqrd, ctx->N, ctx->k0, d, ctx->scratch );
+    _mb_set_ui( ctx->t, 1, d );
+    _mb_montmul( T, ctx->t, ctx->rho_sqrd, ctx->N, ctx->k0, d, ctx->scratch );
+    for ( size_t w = 2; w < ( (size_t) 1 << k ); w++ )
+      _mb_montmul( T + w * v, T + ( w - 1 ) * v, T + v, ctx->N, ctx->k0, d, ctx->scratch );
+
+    // the windows of the longest exponent, from the most significant; the first needs no squarings
+    memcpy( ctx->acc, T, v * sizeof( uint64_t ) );
+    for ( long i = ( bits + k - 1 ) / k - 1; i >= 0; i-- ) {
+      mp_bitcnt_t bit = i * k;
+      for ( size_t l = 0; l < MB_LANES; l++ ) {
+        mpz_ptr   e_l = e[ ( l < n ) ? l : 0 ];
+        size_t    j = bit / GMP_NUMB_BITS, s = bit % GMP_NUMB_BITS;
+        mp_limb_t w = mpz_getlimbn( e_l, j ) >> s;
+        if ( s + k > GMP_NUMB_BITS )
+          w |= mpz_getlimbn( e_l, j + 1 ) << ( GMP_NUMB_BITS - s );
+        ctx->w[ l ] = w & ( ( 1 << k ) - 1 );
+      }
+
+      if ( i != ( bits + k - 1 ) / k - 1 )
+        for ( mp_bitcnt_t j = 0; j < k; j++ )
+          _mb_montmul( ctx->acc, ctx->acc, ctx->acc, ctx->N, ctx->k0, d, ctx->scratch );
+      _mb_gather( ctx->t, T, ctx->w, d );
+      _mb_montmul( ctx->acc, ctx->acc, ctx->t, ctx->N, ctx->k0, d, ctx->scratch );
+    }
+
+    // back from Montgomery representation
+    _mb_set_ui( ctx->t, 1, d );
+    _mb_montmul( ctx->acc, ctx->acc, ctx->t, ctx->N, ctx->k0, d, ctx->scratch );
+    for ( size_t i = 0; i < n; i++ )
+      _mb_to_mpz( r[i], ctx->acc, i, d );
+    return;
+  }
+#endif
+
+  for ( size_t i = 0; i < n; i++ ) {
+    montgomery_ctx_struct * mont = ctx->fallback;
+    if ( ctx->cache != NULL )
+      mont = modulus_montgomery( ctx->cache, modulus_cache_get( ctx->cache, N[i] ) );
+    else
+      montgomery_ctx_set( mont, N[i] );
+    sliding_window_expm_mont( r[i], b[i], e[i], mont );
+  }
+}
+
+
+//**********************************************************************************************************************
+// Fixed-base Exponentiation                                                                                          **
+//**********************************************************************************************************************
+const mp_bitcnt_t fb_teeth = 8; // h <- number of rows the exponent is split into by the comb, the table has 2^h entries
+
+// Initialises an empty fixed-base table. Call fixed_base_set before use and fixed_base_clear after.
+void fixed_base_init( fixed_base_t fb ) {
+  mpz_init( fb->g );
+  montgomery_ctx_init( fb->ctx );
+  barrett_ctx_init( fb->p_barrett );
+  fb->a = 0;
+  fb->G = NULL;
+}
+
+// Points fb at the base g and modulus p, discarding any comb table built for a previous group.
+void fixed_base_set( fixed_base_t fb, mpz_t g, mpz_t p ) {
+  fixed_base_free_table( fb );
+  mpz_mod( fb->g, g, p );
+  montgomery_ctx_set( fb->ctx, p );
+}
+
+void fixed_base_free_table( fixed_base_t fb ) {
+  if ( fb->G == NULL )
+    return;
+
+  for ( size_t i = 0; i < ( (size_t) 1 << fb_teeth ); i++ )
+    mpz_clear( fb->G[i] );
+  free( fb->G );
+  fb->G = NULL;
+  fb->a = 0;
+}
+
+void fixed_base_clear( fixed_base_t fb ) {
+  fixed_base_free_table( fb );
+  mpz_clear( fb->g );
+  montgomery_ctx_clear( fb->ctx );
+  barrett_ctx_clear( fb->p_barrett );
+}
+
+// Builds the Lim-Lee comb table for exponents of up to bits bits. The exponent is split into h = fb_teeth rows of
+// a = ceil(bits/h) bits, so e = sum_j e_j * 2^(j*a). With B_j = g^(2^(j*a)), the table holds
+// G[i] = prod_{j : i_j = 1} B_j for every h-bit i, in Montgomery representation.
+void fixed_base_precompute( fixed_base_t fb, mp_bitcnt_t bits ) {
+  fixed_base_free_table( fb );
+
+  size_t table_n = (size_t) 1 << fb_teeth;
+  fb->a = ( bits + fb_teeth - 1 ) / fb_teeth;
+  fb->G = malloc( table_n * sizeof( mpz_t ) );
+  for ( size_t i = 0; i < table_n; i++ )
+    mpz_init( fb->G[i] );
+
+  // G[0] <- 1, G[2^j] <- B_j = B_{j-1}^(2^a)
+  mpz_set_ui( fb->G[0], 1 );
+  montgomery_to( fb->G[0], fb->G[0], fb->ctx );
+  montgomery_to( fb->G[1], fb->g, fb->ctx );
+  for ( mp_bitcnt_t j = 1; j < fb_teeth; j++ ) {
+    mpz_t * B = &fb->G[ (size_t) 1 << j ];
+    mpz_set( *B, fb->G[ (size_t) 1 << ( j - 1 ) ] );
+    for ( mp_bitcnt_t s = 0; s < fb->a; s++ )
+      Z_N_montsqr( *B, *B, fb->ctx );
+  }
+
+  // G[i] <- G[i without its top bit] * B_(top bit of i), for i not a power of 2
+  for ( size_t i = 3; i < table_n; i++ ) {
+    size_t top = 1;
+    while ( top * 2 <= i )
+      top *= 2;
+    if ( i != top )
+      Z_N_montmul( fb->G[i], fb->G[ i - top ], fb->G[top], fb->ctx );
+  }
+}
+
+// Computes r <- g^e mod p. With a comb table this costs a - 1 squarings and at most a multiplications, against
+// |e| squarings for a sliding window; without one (or if e is too long for it) it falls back to the sliding window.
+// @param e the exponent, a non-negative integer
+void fixed_base_expm( mpz_t r, mpz_t e, fixed_base_t fb ) {
+  if ( fb->G == NULL || mpz_sizeinbase( e, 2 ) > fb_teeth * fb->a ) {
+    sliding_window_expm_mont( r, fb->g, e, fb->ctx );
+    return;
+  }
+
+  mpz_ptr r_hat;
+  mpz_pool_get( fb->ctx->pool, &r_hat, 1 );
+
+  // walk the columns of the comb from the most significant, i.e. r_hat <- r_hat^2 * G[ e_{h-1}[c] .. e_0[c] ]
+  for ( mp_bitcnt_t c = fb->a; c-- > 0; ) {
+    size_t ix = 0;
+    for ( mp_bitcnt_t j = 0; j < fb_teeth; j++ )
+      ix |= (size_t) mpz_tstbit( e, j * fb->a + c ) << j;
+
+    if ( c == fb->a - 1 ) {
+      mpz_set( r_hat, fb->G[ix] );
+      continue;
+    }
+
+    Z_N_montsqr( r_hat, r_hat, fb->ctx );
+    if ( ix != 0 )
+      Z_N_montmul( r_hat, r_hat, fb->G[ix], fb->ctx );
+  }
+
+  montgomery_from( r, r_hat, fb->ctx );
+  mpz_pool_put( fb->ctx->pool, 1 );
+}
+
+
+//**********************************************************************************************************************
+// Per-modulus Context Cache                                                                                          **
+//**********************************************************************************************************************
+
+modulus_cache_stats_t modulus_cache_totals; // the counters of every cache cleared since stage_run started
+
+// Initialises an empty cache, which evicts its least recently used entries once they hold more than budget bytes.
+void modulus_cache_init( modulus_cache_t cache, size_t budget ) {
+  memset( cache->buckets, 0, sizeof( cache->buckets ) );
+  memset( &cache->stats, 0, sizeof( cache->stats ) );
+  cache->newest = NULL;
+  cache->oldest = NULL;
+  cache->n      = 0;
+  cache->bytes  = 0;
+  cache->budget = budget;
+}
+
+// Frees every entry, and adds the counters of the cache to modulus_cache_totals.
+void modulus_cache_clear( modulus_cache_t cache ) {
+  while ( cache->newest != NULL )
+    _modulus_cache_remove( cache, cache->newest );
+
+  __atomic_fetch_add( &modulus_cache_totals.hits,      cache->stats.hits,      __ATOMIC_RELAXED );
+  __atomic_fetch_add( &modulus_cache_totals.misses,    cache->stats.misses,    __ATOMIC_RELAXED );
+  __atomic_fetch_add( &modulus_cache_totals.evictions, cache->stats.evictions, __ATOMIC_RELAXED );
+}
+
+// Mixes the limbs of x into the hash h.
+uint64_t modulus_hash( mpz_t x, uint64_t h ) {
+  const mp_limb_t * x_limbs = mpz_limbs_read( x );
+
+  for ( size_t i = 0; i < mpz_size( x ); i++ ) {
+    h  = ( h ^ x_limbs[i] ) * 0x9E3779B97F4A7C15;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+// Finds the entry for the modulus N, computing nothing for it yet on a miss: its params are computed on first use,
+// by modulus_montgomery, modulus_barrett or modulus_mb_params, so each caller only pays for the ones it needs.
+// The entry may be evicted by later lookups, once MODULUS_CACHE_KEEP other entries have been used since.
+// @param N an odd modulus
+modulus_struct * modulus_cache_get( modulus_cache_t cache, mpz_t N ) {
+  uint64_t         hash = modulus_hash( N, 0 );
+  modulus_struct * mod  = _modulus_cache_find( cache, hash, N, NULL );
+
+  if ( mod == NULL ) {
+    cache->stats.misses++;
+    return _modulus_cache_insert( cache, hash, N, NULL );
+  }
+
+  cache->stats.hits++;
+  _modulus_cache_touch( cache, mod );
+  return mod;
+}
+
+// Finds the entry for the base g mod p, with its fixed-base table. A table costs about as much as one exponentiation
+// to build, so it is only built the second time a group is seen; until then the entry just holds the Montgomery
+// params and fixed_base_expm falls back to the sliding window.
+// @param bits the max length of the exponents that will be used with the entry, e.g. |q|
+modulus_struct * modulus_cache_get_base( modulus_cache_t cache, mpz_t g, mpz_t p, mp_bitcnt_t bits ) {
+  uint64_t         hash = modulus_hash( g, modulus_hash( p, 1 ) );
+  modulus_struct * mod  = _modulus_cache_find( cache, hash, p, g );
+
+  if ( mod == NULL ) {
+    cache->stats.misses++;
+    return _modulus_cache_insert( cache, hash, p, g );
+  }
+
+  cache->stats.hits++;
+  if ( mod->fb->G == NULL || fb_teeth * mod->fb->a < bits )
+    fixed_base_precompute( mod->fb, bits );
+  _modulus_cache_touch( cache, mod );
+  return mod;
+}
+
+// @return the Montgomery params of the modulus of mod, computed on first use
+montgomery_ctx_struct * modulus_montgomery( modulus_cache_t cache, modulus_struct * mod ) {
+  if ( mod->ctx->l_N == 0 ) {
+    montgomery_ctx_set( mod->ctx, mod->ctx->N );
+    _modulus_cache_account( cache, mod );
+  }
+  return mod->ctx;
+}
+
+// @return the Barrett params of the modulus of mod, computed on first use
+barrett_ctx_struct * modulus_barrett( modulus_cache_t cache, modulus_struct * mod ) {
+  if ( mod->bar->l_N == 0 ) {
+    barrett_ctx_set( mod->bar, mod->ctx->N );
+    _modulus_cache_account( cache, mod );
+  }
+  return mod->bar;
+}
+
+// @return the windows of the exponent e for the modulus of mod, recoded unless they are the last recoded for it
+expm_schedule_struct * modulus_schedule( modulus_cache_t cache, modulus_struct * mod, mpz_t e ) {
+  montgomery_ctx_struct * ctx = modulus_montgomery( cache, mod );
+  expm_schedule_set( ctx->sched, e, sliding_window_size( e ) );
+  _modulus_cache_account( cache, mod );
+  return ctx->sched;
+}
+
+// Computes mod->mb_k0 and mod->mb_rho_sqrd for moduli of n digits, unless mod already holds them.
+void modulus_mb_params( modulus_cache_t cache, modulus_struct * mod, size_t n ) {
+  if ( mod->mb_n == n )
+    return;
+
+  _mb_params( &mod->mb_k0, mod->mb_rho_sqrd, mod->ctx->N, n );
+  mod->mb_n = n;
+  _modulus_cache_account( cache, mod );
+}
+
+// @return the entry for N, or for the base g mod N if g is not NULL, or NULL if there is none
+modulus_struct * _modulus_cache_find( modulus_cache_t cache, uint64_t hash, mpz_t N, mpz_t g ) {
+  for ( modulus_struct * mod = cache->buckets[ hash & ( MODULUS_CACHE_BUCKETS - 1 ) ]; mod != NULL; mod = mod->next )
+    if ( mod->hash == hash && mod->has_base == ( g != NULL ) && mpz_cmp( mod->ctx->N, N ) == 0 &&
+         ( g == NULL || mpz_cmp( mod->fb->g, g ) == 0 ) )
+      return mod;
+
+  return NULL;
+}
+
+// Adds a new entry for N, or for the base g mod N, as the most recently used.
+modulus_struct * _modulus_cache_insert( modulus_cache_t cache, uint64_t hash, mpz_t N, mpz_t g ) {
+  modulus_struct * mod = malloc( sizeof( modulus_struct ) );
+  fixed_base_init( mod->fb );
+  mpz_init( mod->mb_rho_sqrd );
+  mod->ctx      = mod->fb->ctx;
+  mod->bar      = mod->fb->p_barrett;
+  mod->hash     = hash;
+  mod->has_base = ( g != NULL );
+  mod->mb_n     = 0;
+  mod->mb_k0    = 0;
+  mod->bytes    = 0;
+
+  // the base needs the Montgomery params right away, N alone only holds on to N until its params are asked for
+  if ( g != NULL )
+    fixed_base_set( mod->fb, g, N );
+  else
+    mpz_set( mod->ctx->N, N );
+
+  modulus_struct ** bucket = &cache->buckets[ hash & ( MODULUS_CACHE_BUCKETS - 1 ) ];
+  mod->next  = *bucket;
+  *bucket    = mod;
+  mod->older = NULL;
+  mod->newer = NULL;
+  cache->n++;
+
+  _modulus_cache_touch( cache, mod );
+  return mod;
+}
+
+// Makes mod the most recently used entry, and evicts others if the cache is over budget.
+void _modulus_cache_touch( modulus_cache_t cache, modulus_struct * mod ) {
+  if ( cache->newest != mod ) {
+    _modulus_cache_unlink( cache, mod );
+    mod->older = cache->newest;
+    mod->newer = NULL;
+    if ( cache->newest != NULL )
+      cache->newest->newer = mod;
+    else
+      cache->oldest = mod;
+    cache->newest = mod;
+  }
+
+  _modulus_cache_account( cache, mod );
+}
+
+// Takes mod out of the recency list.
+void _modulus_cache_unlink( modulus_cache_t cache, modulus_struct * mod ) {
+  if ( mod->newer != NULL )
+    mod->newer->older = mod->older;
+  else if ( cache->newest == mod )
+    cache->newest = mod->older;
+  if ( mod->older != NULL )
+    mod->older->newer = mod->newer;
+  else if ( cache->oldest == mod )
+    cache->oldest = mod->newer;
+  mod->newer = NULL;
+  mod->older = NULL;
+}
+
+// Counts the memory mod holds now, e.g. after it gained params, a table or pooled temporaries, and evicts least
+// recently used entries while the cache is over budget. The MODULUS_CACHE_KEEP most recently used are never evicted,
+// as the caller may still be using them, e.g. the entries for both p and q of an RSA-CRT key.
+void _modulus_cache_account( modulus_cache_t cache, modulus_struct * mod ) {
+  size_t bytes = _modulus_bytes( mod );
+  cache->bytes = cache->bytes - mod->bytes + bytes;
+  mod->bytes   = bytes;
+
+  while ( cache->bytes > cache->budget && cache->n > MODULUS_CACHE_KEEP ) {
+    _modulus_cache_remove( cache, cache->oldest );
+    cache->stats.evictions++;
+  }
+}
+
+// Takes mod out of the cache and frees it.
+void _modulus_cache_remove( modulus_cache_t cache, modulus_struct * mod ) {
+  modulus_struct ** link = &cache->buckets[ mod->hash & ( MODULUS_CACHE_BUCKETS - 1 ) ];
+  while ( *link != mod )
+    link = &( *link )->next;
+  *link = mod->next;
+
+  _modulus_cache_unlink( cache, mod );
+  cache->n--;
+  cache->bytes -= mod->bytes;
+
+  fixed_base_clear( mod->fb );
+  mpz_clear( mod->mb_rho_sqrd );
+  free( mod );
+}
+
+// An estimate of the memory held by mod: the entry itself, and the limbs of its params, table and the temporaries
+// pooled by its contexts, which hold up to a product of two elems each.
+size_t _modulus_bytes( modulus_struct * mod ) {
+  montgomery_ctx_struct * ctx   = mod->ctx;
+  barrett_ctx_struct    * bar   = mod->bar;
+  size_t                  l_N   = mpz_size( ctx->N );
+  size_t                  limbs = 2 * l_N; // N and g
+
+  if ( ctx->l_N != 0 )
+    limbs += 5 * l_N + 2 + ctx->pool->n * 2 * l_N; // rho^2 and the scratch limbs
+  if ( ctx->sched->k != 0 )
+    limbs += mpz_size( ctx->sched->e ) + ctx->sched->size * sizeof( expm_step_t ) / sizeof( mp_limb_t );
+  if ( bar->l_N != 0 )
+    limbs += 8 * l_N + 4 + bar->pool->n * 2 * l_N; // N, mu and the scratch limbs
+  if ( mod->fb->G != NULL )
+    limbs += ( (size_t) 1 << fb_teeth ) * l_N;
+  if ( mod->mb_n != 0 )
+    limbs += mpz_size( mod->mb_rho_sqrd );
+
+  return sizeof( modulus_struct ) + limbs * sizeof( mp_limb_t );
+}
+
+
+//**********************************************************************************************************************
+// ElGamal Precomputation                                                                                             **
+//**********************************************************************************************************************
+
+// Starts precomputing ephemeral keys, up to depth per public key, on a background thread.
+void elgamal_precomp_init( elgamal_precomp_t pc, size_t depth ) {
+  for ( size_t i = 0; i < ELGAMAL_PRECOMP_KEYS; i++ ) {
+    elgamal_queue_struct * queue = &pc->queues[i];
+    mpz_init( queue->p );
+    mpz_init( queue->q );
+    mpz_init( queue->g );
+    mpz_init( queue->h );
+    queue->c1 = malloc( depth * sizeof( mpz_t ) );
+    queue->s  = malloc( depth * sizeof( mpz_t ) );
+    for ( size_t j = 0; j < depth; j++ ) {
+      mpz_init( queue->c1[j] );
+      mpz_init( queue->s[j] );
+    }
+    queue->head  = 0;
+    queue->count = 0;
+    queue->used  = 0;
+    queue->gen   = 0;
+
+    fixed_base_init( pc->g_fb[i] );
+    fixed_base_init( pc->h_fb[i] );
+    mpz_init( pc->fb_q[i] );
+    pc->fb_gen[i] = 0;
+  }
+  pc->n     = 0;
+  pc->depth = depth;
+  pc->clock = 0;
+  pc->stop  = 0;
+
+  csprng_init( pc->rng );
+  mpz_init( pc->k );
+  mpz_init( pc->c1 );
+  mpz_init( pc->s );
+
+  pthread_mutex_init( &pc->lock, NULL );
+  pthread_cond_init( &pc->wake, NULL );
+  pthread_create( &pc->thread, NULL, _elgamal_precomp_run, pc );
+}
+
+// Stops the background thread, waiting for any key it is part way through, and discards the queues.
+void elgamal_precomp_clear( elgamal_precomp_t pc ) {
+  pthread_mutex_lock( &pc->lock );
+  pc->stop = 1;
+  pthread_cond_signal( &pc->wake );
+  pthread_mutex_unlock( &pc->lock );
+  pthread_join( pc->thread, NULL );
+
+  for ( size_t i = 0; i < ELGAMAL_PRECOMP_KEYS; i++ ) {
+    elgamal_queue_struct * queue = &pc->queues[i];
+    mpz_clear( queue->p );
+    mpz_clear( queue->q );
+    mpz_clear( queue->g );
+    mpz_clear( queue->h );
+    for ( size_t j = 0; j < pc->depth; j++ ) {
+      mpz_clear( queue->c1[j] );
+      mpz_clear( queue->s[j] );
+    }
+    free( queue->c1 );
+    free( queue->s );
+
+    fixed_base_clear( pc->g_fb[i] );
+    fixed_base_clear( pc->h_fb[i] );
+    mpz_clear( pc->fb_q[i] );
+  }
+
+  csprng_clear( pc->rng );
+  mpz_clear( pc->k );
+  mpz_clear( pc->c1 );
+  mpz_clear( pc->s );
+
+  pthread_mutex_destroy( &pc->lock );
+  pthread_cond_destroy( &pc->wake );
+}
+
+// Takes a precomputed ephemeral key k for the public key (p, q, g, h), if one is ready. Each k is handed out once.
+// A public key seen for the first time is given a queue, evicting the least recently used one if all are taken,
+// and the background thread is woken to fill it.
+// @param c1 set to g^k mod p
+// @param s  set to h^k mod p in Montgomery representation, may alias h
+// @return   1 if a key was taken, or 0 if none is ready and the caller must compute one itself
+int elgamal_precomp_take( elgamal_precomp_t pc, mpz_t c1, mpz_t s, mpz_t p, mpz_t q, mpz_t g, mpz_t h ) {
+  pthread_mutex_lock( &pc->lock );
+
+  elgamal_queue_struct * queue = NULL;
+  for ( size_t i = 0; i < pc->n && queue == NULL; i++ ) {
+    elgamal_queue_struct * candidate = &pc->queues[i];
+    if ( mpz_cmp( candidate->p, p ) == 0 && mpz_cmp( candidate->g, g ) == 0 && mpz_cmp( candidate->h, h ) == 0 &&
+         mpz_cmp( candidate->q, q ) == 0 )
+      queue = candidate;
+  }
+
+  if ( queue == NULL ) {
+    if ( pc->n < ELGAMAL_PRECOMP_KEYS )
+      queue = &pc->queues[ pc->n++ ];
+    else {
+      queue = &pc->queues[0];
+      for ( size_t i = 1; i < pc->n; i++ )
+        if ( pc->queues[i].used < queue->used )
+          queue = &pc->queues[i];
+    }
+
+    mpz_set( queue->p, p );
+    mpz_set( queue->q, q );
+    mpz_set( queue->g, g );
+    mpz_set( queue->h, h );
+    queue->head  = 0;
+    queue->count = 0;
+    queue->gen++; // keys still being computed for the evicted public key are thrown away
+  }
+  queue->used = ++pc->clock;
+
+  int taken = queue->count > 0;
+  if ( taken ) {
+    mpz_swap( c1, queue->c1[ queue->head ] );
+    mpz_swap( s,  queue->s[ queue->head ] );
+    queue->head = ( queue->head + 1 ) % pc->depth;
+    queue->count--;
+  }
+
+  pthread_cond_signal( &pc->wake );
+  pthread_mutex_unlock( &pc->lock );
+  return taken;
+}
+
+// The background thread: repeatedly tops up the most recently used queue that is not full, sleeping while all are.
+// The exponentiations are done outside the lock, with a comb table for each of g and h, since both are fixed for
+// the life of a queue.
+void * _elgamal_precomp_run( void * arg ) {
+  elgamal_precomp_struct * pc = arg;
+
+  pthread_mutex_lock( &pc->lock );
+  while ( !pc->stop ) {
+    size_t ix = ELGAMAL_PRECOMP_KEYS;
+    for ( size_t i = 0; i < pc->n; i++ ) {
+      if ( pc->queues[i].count == pc->depth )
+        continue;
+      if ( ix == ELGAMAL_PRECOMP_KEYS || pc->queues[i].used > pc->queues[ix].used )
+        ix = i;
+    }
+
+    if ( ix == ELGAMAL_PRECOMP_KEYS ) {
+      pthread_cond_wait( &pc->wake, &pc->lock );
+      continue;
+    }
+
+    // the public key may be replaced once the lock is dropped, so the comb tables take their own copy of it, and
+    // gen tells us below if the key computed from that copy is still wanted
+    elgamal_queue_struct * queue   = &pc->queues[ix];
+    size_t                 gen     = queue->gen;
+    int                    rebuild = pc->fb_gen[ix] != gen;
+    if ( rebuild ) {
+      fixed_base_set( pc->g_fb[ix], queue->g, queue->p );
+      fixed_base_set( pc->h_fb[ix], queue->h, queue->p );
+      mpz_set( pc->fb_q[ix], queue->q );
+      pc->fb_gen[ix] = gen;
+    }
+    pthread_mutex_unlock( &pc->lock );
+
+    if ( rebuild ) {
+      fixed_base_precompute( pc->g_fb[ix], mpz_sizeinbase( pc->fb_q[ix], 2 ) );
+      fixed_base_precompute( pc->h_fb[ix], mpz_sizeinbase( pc->fb_q[ix], 2 ) );
+    }
+
+    // k <- [0..q-1], c1 <- g^k mod p and s <- h^k * rho mod p
+    csprng_urandomm( pc->k, pc->rng, pc->fb_q[ix] );
+    fixed_base_expm( pc->c1, pc->k, pc->g_fb[ix] );
+    fixed_base_expm( pc->s,  pc->k, pc->h_fb[ix] );
+    montgomery_to( pc->s, pc->s, pc->h_fb[ix]->ctx );
+
+    pthread_mutex_lock( &pc->lock );
+    if ( queue->gen == gen && queue->count < pc->depth ) {
+      size_t tail = ( queue->head + queue->count ) % pc->depth;
+      mpz_swap( queue->c1[ tail ], pc->c1 );
+      mpz_swap( queue->s[ tail ],  pc->s );
+      queue->count++;
+    }
+  }
+  pthread_mutex_unlock( &pc->lock );
+
+  return NULL;
+}
+
+
+//**********************************************************************************************************************
+// Tests                                                                                                              **
+//**********************************************************************************************************************
+
+// the randomised differential tests run by ./modmul test, each comparing a primitive against GMP, up to a NULL name
+const test_case_t test_cases[] = {
+  { "hex",         test_hex               },
+  { "montgomery",  test_montgomery        },
+  { "sw",          test_sliding_window    },
+  { "sched",       test_expm_schedule     },
+  { "barrett",     test_barrett           },
+  { "multi",       test_multi_expm        },
+  { "mb",          test_mb_expm           },
+  { "fixed_base",  test_fixed_base        },
+  { "cache",       test_modulus_cache     },
+  { "invert",      test_invertm_batch     },
+  { "rsa_crt",     test_rsa_crt           },
+  { "rsa_multi",   test_rsa_crt_multi     },
+  { "elgamal",     test_elgamal           },
+  { "precomp",     test_elgamal_precomp   },
+  { "csprng",      test_csprng            },
+  { NULL,          NULL                   }
+};
+
+// Runs one test with a fixed seed, so a failure can be reproduced, and reports it on stderr.
+// @return the number of failed cases
+int test_run( const char * name, int ( * fn )( gmp_randstate_t state ) ) {
+  gmp_randstate_t state;
+  gmp_randinit_default( state );
+  gmp_randseed_ui( state, TEST_SEED );
+
+  int failed = fn( state );
+  fprintf( stderr, "%-12s %s\n", name, ( failed == 0 ) ? "ok" : "FAIL" );
+
+  gmp_randclear( state );
+  return failed;
+}
+
+// Reports a case where got != want.
+// @return 1 if they differ, else 0
+int test_expect( const char * what, size_t i, mpz_t got, mpz_t want ) {
+  if ( mpz_cmp( got, want ) == 0 )
+    return 0;
+
+  gmp_fprintf( stderr, "%s, case %zu:\n  got  %ZX\n  want %ZX\n", what, i, got, want );
+  return 1;
+}
+
+// Sets N to a random odd modulus of up to max_bits bits. Every eighth is 2^|N| - 1, all ones, to exercise carries,
+// and the length is often a whole number of limbs, or one of the lengths with specialised kernels.
+void test_modulus( mpz_t N, gmp_randstate_t state, mp_bitcnt_t max_bits ) {
+  mp_bitcnt_t bits = 2 + gmp_urandomm_ui( state, max_bits - 1 );
+  switch ( gmp_urandomm_ui( state, 4 ) ) {
+    case 0:
+      bits = GMP_NUMB_BITS * ( 1 + gmp_urandomm_ui( state, max_bits / GMP_NUMB_BITS ) );
+      break;
+    case 1: {
+      size_t n = 0;
+      while ( montgomery_kernels[n].l_N != 0 && montgomery_kernels[n].l_N * GMP_NUMB_BITS <= max_bits )
+        n++;
+      if ( n != 0 )
+        bits = GMP_NUMB_BITS * montgomery_kernels[ gmp_urandomm_ui( state, n ) ].l_N;
+      break;
+    }
+  }
+
+  if ( gmp_urandomm_ui( state, 8 ) == 0 ) {
+    mpz_set_ui( N, 0 );
+    mpz_setbit( N, bits );
+    mpz_sub_ui( N, N, 1 );
+    return;
+  }
+
+  mpz_urandomb( N, state, bits );
+  mpz_setbit( N, bits - 1 );
+  mpz_setbit( N, 0 );
+}
+
+// Sets x to a random elem of Z_N, sometimes 0, 1 or N - 1.
+void test_elem( mpz_t x, gmp_randstate_t state, mpz_t N ) {
+  switch ( gmp_urandomm_ui( state, 16 ) ) {
+    case 0:  mpz_set_ui( x, 0 );     break;
+    case 1:  mpz_set_ui( x, 1 );     break;
+    case 2:  mpz_sub_ui( x, N, 1 );  break;
+    default: mpz_urandomm( x, state, N );
+  }
+}
+
+// Sets p, q and g to a group of 160-bit prime order q in Z_p^*, for a 512-bit p = q * r + 1, generated by g = a^r.
+void test_group( mpz_t p, mpz_t q, mpz_t g, gmp_randstate_t state ) {
+  mpz_t r;
+  mpz_init( r );
+  do {
+    mpz_urandomb( q, state, 160 );
+    mpz_setbit( q, 159 );
+    mpz_nextprime( q, q );
+    mpz_urandomb( r, state, 352 );
+    mpz_setbit( r, 351 );
+    mpz_clrbit( r, 0 );
+    mpz_mul( p, q, r );
+    mpz_add_ui( p, p, 1 );
+  } while ( !mpz_probab_prime_p( p, 25 ) );
+  do {
+    mpz_urandomm( g, state, p );
+    mpz_powm( g, g, r, p );
+  } while ( mpz_cmp_ui( g, 1 ) <= 0 );
+  mpz_clear( r );
+}
+
+// Looks up the queue of pc for the public key h, as the background thread may be filling it.
+// @param head set to the index of the next key the queue hands out
+// @return     1 if the queue has a key ready, else 0
+int test_precomp_ready( elgamal_precomp_t pc, mpz_t h, size_t * head ) {
+  int ready = 0;
+  pthread_mutex_lock( &pc->lock );
+  for ( size_t i = 0; i < pc->n; i++ )
+    if ( mpz_cmp( pc->queues[i].h, h ) == 0 ) {
+      *head = pc->queues[i].head;
+      ready = pc->queues[i].count > 0;
+    }
+  pthread_mutex_unlock( &pc->lock );
+  return ready;
+}
+
+// hex_reader_next and hex_writer_put against mpz_set_str and gmp_printf
+int test_hex( gmp_randstate_t state ) {
+  int    failed = 0;
+  mpz_t  x[ TEST_CASES ], got, want;
+  char * text;
+  size_t size;
+
+  mpz_init( got );
+  mpz_init( want );
+
+  // write every x, then read them back
+  FILE * out = open_memstream( &text, &size );
+  hex_writer_t wr;
+  hex_writer_init( &wr, out );
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    mpz_init( x[i] );
+    mpz_urandomb( x[i], state, gmp_urandomm_ui( state, 4096 ) );
+    hex_writer_put( &wr, x[i] );
+  }
+  hex_writer_flush( &wr );
+  hex_writer_clear( &wr );
+  fclose( out );
+
+  FILE * in = fmemopen( text, size, "r" );
+  hex_reader_t rd;
+  hex_reader_init( &rd, in );
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    // the line as gmp_printf would write it
+    char * line = NULL;
+    gmp_asprintf( &line, "%ZX", x[i] );
+    mpz_set_str( want, line, 16 );
+    free( line );
+
+    if ( hex_reader_next( &rd, got ) != 1 )
+      mpz_set_si( got, -1 );
+    failed += test_expect( "hex round trip", i, got, want );
+  }
+  if ( hex_reader_next( &rd, got ) != 0 ) {
+    fprintf( stderr, "hex reader: expected the end of the input\n" );
+    failed++;
+  }
+  hex_reader_clear( &rd );
+  fclose( in );
+  free( text );
+
+  // lines that are not hex integer literals
+  const char * bad[] = { "\n", "12G4\n", "-1\n" };
+  for ( size_t i = 0; i < sizeof( bad ) / sizeof( bad[0] ); i++ ) {
+    in = fmemopen( (void *) bad[i], strlen( bad[i] ), "r" );
+    hex_reader_init( &rd, in );
+    if ( hex_reader_next( &rd, got ) != -1 ) {
+      fprintf( stderr, "hex reader: accepted bad line %zu\n", i );
+      failed++;
+    }
+    hex_reader_clear( &rd );
+    fclose( in );
+  }
+
+  for ( size_t i = 0; i < TEST_CASES; i++ )
+    mpz_clear( x[i] );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// mulm, mulm_ctx, Z_N_montmul, Z_N_montsqr and montgomery_to/from against mpz_mul and mpz_mod
+int test_montgomery( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, x, y, rho, got, want;
+  mpz_init( N );
+  mpz_init( x );
+  mpz_init( y );
+  mpz_init( rho );
+  mpz_init( got );
+  mpz_init( want );
+
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 4096 );
+    test_elem( x, state, N );
+    test_elem( y, state, N );
+    montgomery_ctx_set( ctx, N );
+
+    // x * y mod N
+    mpz_mul( want, x, y );
+    mpz_mod( want, want, N );
+    mulm( got, x, y, N );
+    failed += test_expect( "mulm", i, got, want );
+    mulm_ctx( got, x, y, ctx );
+    failed += test_expect( "mulm_ctx", i, got, want );
+
+    // x * y * rho^-1 mod N, and x^2 * rho^-1 mod N
+    mpz_set_ui( rho, 0 );
+    mpz_setbit( rho, ctx->l_N * GMP_NUMB_BITS );
+    mpz_invert( rho, rho, N );
+    mpz_mul( want, want, rho );
+    mpz_mod( want, want, N );
+    Z_N_montmul( got, x, y, ctx );
+    failed += test_expect( "Z_N_montmul", i, got, want );
+
+    mpz_mul( want, x, x );
+    mpz_mul( want, want, rho );
+    mpz_mod( want, want, N );
+    mpz_set( got, x );
+    Z_N_montsqr( got, got, ctx ); // aliased
+    failed += test_expect( "Z_N_montsqr", i, got, want );
+
+    // to and back
+    montgomery_to( got, x, ctx );
+    montgomery_from( got, got, ctx );
+    failed += test_expect( "montgomery_to/from", i, got, x );
+  }
+
+  montgomery_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( x );
+  mpz_clear( y );
+  mpz_clear( rho );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// sliding_window_expm and sliding_window_expm_mont, with every window size, against mpz_powm
+int test_sliding_window( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, b, e, got, want;
+  mpz_init( N );
+  mpz_init( b );
+  mpz_init( e );
+  mpz_init( got );
+  mpz_init( want );
+
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 2048 );
+    mpz_urandomb( b, state, mpz_sizeinbase( N, 2 ) + 8 ); // not necessarily reduced
+    mpz_urandomb( e, state, gmp_urandomm_ui( state, 1200 ) );
+    montgomery_ctx_set( ctx, N );
+    mpz_powm( want, b, e, N );
+
+    sliding_window_expm( got, b, e, N );
+    failed += test_expect( "sliding_window_expm", i, got, want );
+    sliding_window_expm_mont( got, b, e, ctx );
+    failed += test_expect( "sliding_window_expm_mont", i, got, want );
+
+    mp_bitcnt_t k = 1 + i % k_max;
+    sliding_window_expm_k( got, b, e, N, k );
+    failed += test_expect( "sliding_window_expm_k", i, got, want );
+    sliding_window_expm_mont_k( got, b, e, ctx, k );
+    failed += test_expect( "sliding_window_expm_mont_k", i, got, want );
+  }
+
+  montgomery_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( b );
+  mpz_clear( e );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// expm_schedule_set, by rebuilding the exponent from its windows, and the exponentiations that replay a schedule, for
+// exponents with runs of trailing zeros or none at all, against mpz_powm
+int test_expm_schedule( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, e, got, want, b[ TEST_BASES ], y[ TEST_BASES ], r[ TEST_BASES ];
+  mpz_init( N );
+  mpz_init( e );
+  mpz_init( got );
+  mpz_init( want );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_init( b[j] );
+    mpz_init( y[j] );
+    mpz_init( r[j] );
+  }
+
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+  expm_schedule_t s;
+  expm_schedule_init( s );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 1024 );
+    montgomery_ctx_set( ctx, N );
+    mp_bitcnt_t k = 1 + i % k_max;
+    if ( i % 16 == 0 )
+      mpz_set_ui( e, 0 );
+    else
+      mpz_urandomb( e, state, gmp_urandomm_ui( state, 600 ) );
+    if ( i % 3 == 0 )
+      mpz_mul_2exp( e, e, gmp_urandomm_ui( state, 80 ) );
+    expm_schedule_set( s, e, k );
+
+    // e = ( ( digit_0 * 2^shift_1 + digit_1 ) * 2^shift_2 + ... ) * 2^tail, with every digit an odd k-bit value that
+    // indexes the table
+    mpz_set_ui( got, 0 );
+    for ( size_t q = 0; q < s->n; q++ ) {
+      expm_step_t step = s->steps[q];
+      if ( step.digit % 2 == 0 || ( step.digit >> k ) != 0 || step.digit / 2 >= s->T_n ) {
+        mpz_set_si( got, -1 );
+        break;
+      }
+      mpz_mul_2exp( got, got, step.shift );
+      mpz_add_ui( got, got, step.digit );
+    }
+    if ( mpz_sgn( got ) >= 0 )
+      mpz_mul_2exp( got, got, s->tail );
+    failed += test_expect( "expm_schedule_set", i, got, e );
+
+    // the schedule is replayed for several bases, and once more after setting it again with the same exponent
+    size_t n = 1 + gmp_urandomm_ui( state, TEST_BASES );
+    mpz_ptr b_ptr[ TEST_BASES ], y_ptr[ TEST_BASES ], r_ptr[ TEST_BASES ];
+    for ( size_t j = 0; j < n; j++ ) {
+      test_elem( b[j], state, N );
+      test_elem( y[j], state, N );
+      b_ptr[j] = b[j];
+      y_ptr[j] = y[j];
+      r_ptr[j] = r[j];
+    }
+
+    mpz_powm( want, b[0], e, N );
+    sliding_window_expm_mont_sched( got, b[0], s, ctx );
+    failed += test_expect( "sliding_window_expm_mont_sched", i, got, want );
+    expm_schedule_set( s, e, k );
+    sliding_window_expm_mont_sched( got, b[0], s, ctx );
+    failed += test_expect( "sliding_window_expm_mont_sched again", i, got, want );
+
+    sliding_window_expm_mont_mul_n_sched( r_ptr, b_ptr, ( i % 2 == 0 ) ? y_ptr : NULL, n, s, ctx );
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( want, b[j], e, N );
+      if ( i % 2 == 0 ) {
+        mpz_mul( want, want, y[j] );
+        mpz_mod( want, want, N );
+      }
+      failed += test_expect( "sliding_window_expm_mont_mul_n_sched", i, r[j], want );
+    }
+  }
+
+  expm_schedule_clear( s );
+  montgomery_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( e );
+  mpz_clear( got );
+  mpz_clear( want );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_clear( b[j] );
+    mpz_clear( y[j] );
+    mpz_clear( r[j] );
+  }
+  return failed;
+}
+
+// barrett_reduce, mulm_barrett, sqrm_barrett and sliding_window_expm_barrett, for odd and even moduli, against mpz_mod
+// and mpz_powm
+int test_barrett( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, x, y, e, got, want;
+  mpz_init( N );
+  mpz_init( x );
+  mpz_init( y );
+  mpz_init( e );
+  mpz_init( got );
+  mpz_init( want );
+
+  barrett_ctx_t ctx;
+  barrett_ctx_init( ctx );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 4096 );
+    if ( i % 2 )
+      mpz_clrbit( N, 0 ); // Barrett reduction works for even moduli too
+    if ( mpz_cmp_ui( N, 2 ) < 0 )
+      mpz_set_ui( N, 2 );
+    if ( i % 16 == 1 ) {
+      mpz_set_ui( N, 0 );
+      mpz_setbit( N, ( i / 16 ) * GMP_NUMB_BITS ); // b^(l_N-1), whose mu = b^(l_N+1) is a limb longer than any other
+    }
+    test_elem( x, state, N );
+    test_elem( y, state, N );
+    barrett_ctx_set( ctx, N );
+
+    // any x < b^(2*l_N), sometimes the largest
+    mp_bitcnt_t bits = 2 * ctx->l_N * GMP_NUMB_BITS;
+    mpz_urandomb( e, state, bits );
+    if ( i % 8 == 0 ) {
+      mpz_set_ui( e, 0 );
+      mpz_setbit( e, bits );
+      mpz_sub_ui( e, e, 1 );
+    }
+    mpz_mod( want, e, N );
+    barrett_reduce( got, e, ctx );
+    failed += test_expect( "barrett_reduce", i, got, want );
+
+    mpz_mul( want, x, y );
+    mpz_mod( want, want, N );
+    mulm_barrett( got, x, y, ctx );
+    failed += test_expect( "mulm_barrett", i, got, want );
+
+    mpz_mul( want, x, x );
+    mpz_mod( want, want, N );
+    mpz_set( got, x );
+    sqrm_barrett( got, got, ctx ); // aliased
+    failed += test_expect( "sqrm_barrett", i, got, want );
+
+    if ( i % 4 == 0 ) {
+      mpz_urandomb( x, state, mpz_sizeinbase( N, 2 ) + 8 );
+      mpz_urandomb( e, state, gmp_urandomm_ui( state, 1200 ) );
+      mpz_powm( want, x, e, N );
+      sliding_window_expm_barrett_k( got, x, e, ctx, 1 + i % k_max );
+      failed += test_expect( "sliding_window_expm_barrett_k", i, got, want );
+    }
+  }
+
+  barrett_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( x );
+  mpz_clear( y );
+  mpz_clear( e );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// multi_expm_mont, sliding_window_expm_mont_n and sliding_window_expm_mont_mul_n against products of mpz_powm
+int test_multi_expm( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, b[ TEST_BASES ], e[ TEST_BASES ], y[ TEST_BASES ], r[ TEST_BASES ], got, want, t;
+  mpz_ptr bs[ TEST_BASES ], es[ TEST_BASES ], ys[ TEST_BASES ], rs[ TEST_BASES ];
+  mpz_init( N );
+  mpz_init( got );
+  mpz_init( want );
+  mpz_init( t );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_init( b[j] ); bs[j] = b[j];
+    mpz_init( e[j] ); es[j] = e[j];
+    mpz_init( y[j] ); ys[j] = y[j];
+    mpz_init( r[j] ); rs[j] = r[j];
+  }
+
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 1024 );
+    montgomery_ctx_set( ctx, N );
+
+    size_t n = 1 + i % TEST_BASES;
+    for ( size_t j = 0; j < n; j++ ) {
+      test_elem( b[j], state, N );
+      test_elem( y[j], state, N );
+      mpz_urandomb( e[j], state, gmp_urandomm_ui( state, 700 ) );
+    }
+
+    // prod b[j]^e[j]
+    mpz_set_ui( want, 1 );
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( t, b[j], e[j], N );
+      mpz_mul( want, want, t );
+      mpz_mod( want, want, N );
+    }
+    multi_expm_mont( got, bs, es, n, ctx );
+    failed += test_expect( "multi_expm_mont", i, got, want );
+
+    // b[j]^e[0] and b[j]^e[0] * y[j], each j
+    sliding_window_expm_mont_n( rs, bs, n, e[0], ctx );
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( want, b[j], e[0], N );
+      failed += test_expect( "sliding_window_expm_mont_n", i, r[j], want );
+    }
+    sliding_window_expm_mont_mul_n( rs, bs, ys, n, e[0], ctx, 1 + i % k_max );
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( want, b[j], e[0], N );
+      mpz_mul( want, want, y[j] );
+      mpz_mod( want, want, N );
+      failed += test_expect( "sliding_window_expm_mont_mul_n", i, r[j], want );
+    }
+  }
+
+  montgomery_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( got );
+  mpz_clear( want );
+  mpz_clear( t );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_clear( b[j] );
+    mpz_clear( e[j] );
+    mpz_clear( y[j] );
+    mpz_clear( r[j] );
+  }
+  return failed;
+}
+
+// mb_expm, for batches of every size and moduli of mixed lengths, against mpz_powm
+int test_mb_expm( gmp_randstate_t state ) {
+  int     failed = 0;
+  mpz_t   N[ MB_LANES ], b[ MB_LANES ], e[ MB_LANES ], r[ MB_LANES ], want;
+  mpz_ptr Ns[ MB_LANES ], bs[ MB_LANES ], es[ MB_LANES ], rs[ MB_LANES ];
+  mpz_init( want );
+  for ( size_t l = 0; l < MB_LANES; l++ ) {
+    mpz_init( N[l] ); Ns[l] = N[l];
+    mpz_init( b[l] ); bs[l] = b[l];
+    mpz_init( e[l] ); es[l] = e[l];
+    mpz_init( r[l] ); rs[l] = r[l];
+  }
+
+  mb_ctx_t ctx;
+  mb_ctx_init( ctx );
+  modulus_cache_t cache;
+  modulus_cache_init( cache, 64 * 1024 );
+
+  for ( size_t i = 0; i < TEST_CASES / 4; i++ ) {
+    ctx->cache = ( i % 2 ) ? cache : NULL; // with the params of each modulus kept in a cache, and without
+    size_t      n    = 1 + i % MB_LANES;
+    mp_bitcnt_t bits = 3 + gmp_urandomm_ui( state, ( i % 8 == 0 ) ? MB_MAX_BITS - 2 : 1200 );
+    for ( size_t l = 0; l < n; l++ ) {
+      // mostly the same length, sometimes shorter
+      mpz_urandomb( N[l], state, ( l % 4 == 3 ) ? 2 + gmp_urandomm_ui( state, bits - 1 ) : bits );
+      mpz_setbit( N[l], 0 );
+      mpz_setbit( N[l], 1 );
+      mpz_urandomb( b[l], state, bits + 8 );
+      mpz_urandomb( e[l], state, gmp_urandomm_ui( state, ( i % 8 == 0 ) ? 600 : 1100 ) );
+    }
+
+    mb_expm( rs, bs, es, Ns, n, ctx );
+    for ( size_t l = 0; l < n; l++ ) {
+      mpz_powm( want, b[l], e[l], N[l] );
+      failed += test_expect( "mb_expm", i, r[l], want );
+    }
+  }
+
+  // in place, with params from the cache for the moduli of the last case
+  for ( size_t l = 0; l < MB_LANES; l++ )
+    mpz_powm( r[l], b[l], e[l], N[l] );
+  mb_expm( bs, bs, es, Ns, MB_LANES, ctx );
+  for ( size_t l = 0; l < MB_LANES; l++ )
+    failed += test_expect( "mb_expm (in place)", l, b[l], r[l] );
+
+  mb_ctx_clear( ctx );
+  modulus_cache_clear( cache );
+  mpz_clear( want );
+  for ( size_t l = 0; l < MB_LANES; l++ ) {
+    mpz_clear( N[l] );
+    mpz_clear( b[l] );
+    mpz_clear( e[l] );
+    mpz_clear( r[l] );
+  }
+  return failed;
+}
+
+// fixed_base_expm, with and without a comb table and for exponents too long for the table, against mpz_powm
+int test_fixed_base( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, g, e, got, want;
+  mpz_init( N );
+  mpz_init( g );
+  mpz_init( e );
+  mpz_init( got );
+  mpz_init( want );
+
+  fixed_base_t fb;
+  fixed_base_init( fb );
+
+  for ( size_t i = 0; i < TEST_CASES / 4; i++ ) {
+    test_modulus( N, state, 1024 );
+    test_elem( g, state, N );
+    mp_bitcnt_t bits = 1 + gmp_urandomm_ui( state, 300 );
+    fixed_base_set( fb, g, N );
+
+    for ( int table = 0; table < 2; table++ ) {
+      if ( table )
+        fixed_base_precompute( fb, bits );
+
+      for ( size_t j = 0; j < 4; j++ ) {
+        mpz_urandomb( e, state, ( j == 3 ) ? bits + 20 : bits );
+        mpz_powm( want, g, e, N );
+        fixed_base_expm( got, e, fb );
+        failed += test_expect( "fixed_base_expm", i, got, want );
+      }
+    }
+  }
+
+  fixed_base_clear( fb );
+  mpz_clear( N );
+  mpz_clear( g );
+  mpz_clear( e );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// modulus_cache_t: random lookups among a few moduli and groups, with a budget small enough to evict, checking that
+// each entry holds its own modulus and that its params and tables give the same results as GMP
+int test_modulus_cache( gmp_randstate_t state ) {
+  int     failed = 0;
+  mpz_t   N[ TEST_MODULI ], g[ TEST_MODULI ], x, y, e, got, want;
+  uint64_t k0;
+  for ( size_t j = 0; j < TEST_MODULI; j++ ) {
+    mpz_init( N[j] );
+    mpz_init( g[j] );
+    test_modulus( N[j], state, 1024 );
+    if ( mpz_cmp_ui( N[j], 3 ) < 0 )
+      mpz_set_ui( N[j], 3 );
+    test_elem( g[j], state, N[j] );
+  }
+  mpz_init( x );
+  mpz_init( y );
+  mpz_init( e );
+  mpz_init( got );
+  mpz_init( want );
+
+  modulus_cache_t cache;
+  modulus_cache_init( cache, 64 * 1024 );
+  unsigned long lookups = 0;
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    size_t j = gmp_urandomm_ui( state, TEST_MODULI ), k = gmp_urandomm_ui( state, TEST_MODULI );
+    test_elem( x, state, N[j] );
+    test_elem( y, state, N[j] );
+
+    switch ( i % 4 ) {
+      case 0: {
+        // two entries at once, as for the p and q of an RSA-CRT key
+        modulus_struct * mod_j = modulus_cache_get( cache, N[j] );
+        modulus_struct * mod_k = modulus_cache_get( cache, N[k] );
+        lookups += 2;
+        mpz_mul( want, x, y );
+        mpz_mod( want, want, N[j] );
+        mulm_ctx( got, x, y, modulus_montgomery( cache, mod_j ) );
+        failed += test_expect( "modulus_montgomery", i, got, want );
+        test_elem( x, state, N[k] );
+        mpz_mul( want, x, x );
+        mpz_mod( want, want, N[k] );
+        mulm_barrett( got, x, x, modulus_barrett( cache, mod_k ) );
+        failed += test_expect( "modulus_barrett", i, got, want );
+        failed += test_expect( "modulus_cache_get", i, mod_j->ctx->N, N[j] );
+        break;
+      }
+      case 1: {
+        // the multi-buffer params for the modulus' own length, and sometimes a longer one
+        size_t           n   = ( mpz_sizeinbase( N[j], 2 ) + MB_DIGIT_BITS - 1 ) / MB_DIGIT_BITS + i % 8 / 4;
+        modulus_struct * mod = modulus_cache_get( cache, N[j] );
+        lookups++;
+        modulus_mb_params( cache, mod, n );
+        _mb_params( &k0, want, N[j], n );
+        failed += test_expect( "modulus_mb_params", i, mod->mb_rho_sqrd, want );
+        mpz_set_ui( got, mod->mb_k0 );
+        mpz_set_ui( want, k0 );
+        failed += test_expect( "modulus_mb_params (k0)", i, got, want );
+        break;
+      }
+      default: {
+        // fixed-base entries, with a table from the second lookup on
+        mp_bitcnt_t      bits = 160 + 8 * j;
+        modulus_struct * mod  = modulus_cache_get_base( cache, g[j], N[j], bits );
+        lookups++;
+        mpz_urandomb( e, state, bits );
+        mpz_powm( want, g[j], e, N[j] );
+        fixed_base_expm( got, e, mod->fb );
+        failed += test_expect( "modulus_cache_get_base", i, got, want );
+        break;
+      }
+    }
+
+    if ( cache->bytes > cache->budget && cache->n > MODULUS_CACHE_KEEP ) {
+      fprintf( stderr, "modulus_cache, case %zu: %zu bytes held over a budget of %zu\n", i, cache->bytes,
+               cache->budget );
+      failed++;
+    }
+  }
+
+  if ( cache->stats.hits + cache->stats.misses != lookups || cache->stats.hits == 0 ||
+       cache->stats.evictions == 0 ) {
+    fprintf( stderr, "modulus_cache: %lu hits and %lu misses in %lu lookups, %lu evictions\n", cache->stats.hits,
+             cache->stats.misses, lookups, cache->stats.evictions );
+    failed++;
+  }
+
+  modulus_cache_clear( cache );
+  for ( size_t j = 0; j < TEST_MODULI; j++ ) {
+    mpz_clear( N[j] );
+    mpz_clear( g[j] );
+  }
+  mpz_clear( x );
+  mpz_clear( y );
+  mpz_clear( e );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// invertm_batch against mpz_invert, including a batch with an elem that has no inverse
+int test_invertm_batch( gmp_randstate_t state ) {
+  int     failed = 0;
+  mpz_t   N, x[ TEST_BASES ], got, want;
+  mpz_ptr xs[ TEST_BASES ];
+  mpz_init( N );
+  mpz_init( got );
+  mpz_init( want );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_init( x[j] );
+    xs[j] = x[j];
+  }
+
+  montgomery_ctx_t ctx;
+  montgomery_ctx_init( ctx );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    test_modulus( N, state, 2048 );
+    montgomery_ctx_set( ctx, N );
+
+    // random invertible elems, in Montgomery representation
+    size_t n = 1 + i % TEST_BASES;
+    for ( size_t j = 0; j < n; j++ ) {
+      do
+        mpz_urandomm( x[j], state, N );
+      while ( !mpz_invert( got, x[j], N ) );
+    }
+    mpz_set( want, x[0] ); // x[0], to check its inverse below
+
+    for ( size_t j = 0; j < n; j++ )
+      montgomery_to( x[j], x[j], ctx );
+    if ( !invertm_batch( xs, xs, n, ctx ) ) {
+      fprintf( stderr, "invertm_batch, case %zu: failed on invertible elems\n", i );
+      failed++;
+      continue;
+    }
+
+    montgomery_from( got, x[0], ctx );
+    mpz_invert( want, want, N );
+    failed += test_expect( "invertm_batch", i, got, want );
+
+    // 0 has no inverse, and leaves the batch as it was
+    mpz_set_ui( x[ n - 1 ], 0 );
+    mpz_set( want, x[0] );
+    if ( invertm_batch( xs, xs, n, ctx ) ) {
+      fprintf( stderr, "invertm_batch, case %zu: inverted 0\n", i );
+      failed++;
+    }
+    failed += test_expect( "invertm_batch (unchanged)", i, x[0], want );
+  }
+
+  montgomery_ctx_clear( ctx );
+  mpz_clear( N );
+  mpz_clear( got );
+  mpz_clear( want );
+  for ( size_t j = 0; j < TEST_BASES; j++ )
+    mpz_clear( x[j] );
+  return failed;
+}
+
+// rsa_crt_decrypt, with and without --parallel-crt, against mpz_powm( m, c, d, N )
+int test_rsa_crt( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t p, q, N, phi, e, d, d_p, d_q, i_q, c, got, want;
+  mpz_init( p );
+  mpz_init( q );
+  mpz_init( N );
+  mpz_init( phi );
+  mpz_init( e );
+  mpz_init( d );
+  mpz_init( d_p );
+  mpz_init( d_q );
+  mpz_init( i_q );
+  mpz_init( c );
+  mpz_init( got );
+  mpz_init( want );
+
+  rsa_crt_key_t key;
+  rsa_crt_key_init( key );
+  int parallel_crt = opt_parallel_crt;
+
+  mpz_set_ui( e, 65537 );
+  for ( size_t i = 0; i < TEST_CASES / 8; i++ ) {
+    // distinct primes p and q for which e is invertible mod (p-1)(q-1)
+    mp_bitcnt_t bits = 64 + gmp_urandomm_ui( state, 960 );
+    do {
+      mpz_urandomb( p, state, bits );
+      mpz_setbit( p, bits - 1 );
+      mpz_nextprime( p, p );
+      mpz_urandomb( q, state, bits );
+      mpz_setbit( q, bits - 1 );
+      mpz_nextprime( q, q );
+      mpz_sub_ui( d_p, p, 1 );
+      mpz_sub_ui( d_q, q, 1 );
+      mpz_mul( phi, d_p, d_q );
+    } while ( mpz_cmp( p, q ) == 0 || !mpz_invert( d, e, phi ) );
+
+    mpz_mul( N, p, q );
+    mpz_mod( d_p, d, d_p );
+    mpz_mod( d_q, d, d_q );
+    mpz_invert( i_q, q, p );
+    rsa_crt_key_set( key, p, q, d_p, d_q, i_q );
+
+    test_elem( c, state, N );
+    mpz_powm( want, c, d, N );
+
+    opt_parallel_crt = i % 2;
+    rsa_crt_decrypt( got, c, key );
+    failed += test_expect( "rsa_crt_decrypt", i, got, want );
+  }
+
+  opt_parallel_crt = parallel_crt;
+  rsa_crt_key_clear( key );
+  mpz_clear( p );
+  mpz_clear( q );
+  mpz_clear( N );
+  mpz_clear( phi );
+  mpz_clear( e );
+  mpz_clear( d );
+  mpz_clear( d_p );
+  mpz_clear( d_q );
+  mpz_clear( i_q );
+  mpz_clear( c );
+  mpz_clear( got );
+  mpz_clear( want );
+  return failed;
+}
+
+// rsa_crt_decrypt for keys of 2 to RSA_PRIMES_MAX primes, with the key's own params and with a cache that keeps only
+// MODULUS_CACHE_KEEP entries, with and without --parallel-crt, against mpz_powm( m, c, d, N )
+int test_rsa_crt_multi( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t N, phi, e, d, c, got, want, P[ RSA_PRIMES_MAX ], D[ RSA_PRIMES_MAX ], T[ RSA_PRIMES_MAX ];
+  mpz_init( N );
+  mpz_init( phi );
+  mpz_init( e );
+  mpz_init( d );
+  mpz_init( c );
+  mpz_init( got );
+  mpz_init( want );
+  for ( size_t j = 0; j < RSA_PRIMES_MAX; j++ ) {
+    mpz_init( P[j] );
+    mpz_init( D[j] );
+    mpz_init( T[j] );
+  }
+
+  rsa_crt_key_t key;
+  rsa_crt_key_init( key );
+  modulus_cache_t cache;
+  modulus_cache_init( cache, 0 );
+  int parallel_crt = opt_parallel_crt;
+
+  mpz_set_ui( e, 65537 );
+  for ( size_t i = 0; i < TEST_CASES / 8; i++ ) {
+    // u distinct primes for which e is invertible mod phi = (p-1)(q-1)(r_3-1)...
+    size_t      u    = 2 + i % ( RSA_PRIMES_MAX - 1 );
+    mp_bitcnt_t bits = 64 + gmp_urandomm_ui( state, 512 );
+    int         distinct;
+    do {
+      mpz_set_ui( N, 1 );
+      mpz_set_ui( phi, 1 );
+      distinct = 1;
+      for ( size_t j = 0; j < u; j++ ) {
+        mpz_urandomb( P[j], state, bits );
+        mpz_setbit( P[j], bits - 1 );
+        mpz_nextprime( P[j], P[j] );
+        distinct = distinct && mpz_divisible_p( N, P[j] ) == 0;
+        mpz_mul( N, N, P[j] );
+        mpz_sub_ui( D[j], P[j], 1 );
+        mpz_mul( phi, phi, D[j] );
+      }
+    } while ( !distinct || !mpz_invert( d, e, phi ) );
+
+    // d_i <- d mod (r_i - 1), q^-1 mod p for q, then ( p * q * ... r_(i-1) )^-1 mod r_i for each r_i after q
+    mpz_set_ui( phi, 1 );
+    for ( size_t j = 0; j < u; j++ ) {
+      mpz_mod( D[j], d, D[j] );
+      if ( j >= 2 )
+        mpz_invert( T[j], phi, P[j] );
+      mpz_mul( phi, phi, P[j] );
+    }
+    mpz_invert( T[1], P[1], P[0] );
+
+    if ( i % 2 == 0 ) {
+      rsa_crt_key_set( key, P[0], P[1], D[0], D[1], T[1] );
+      for ( size_t j = 2; j < u; j++ )
+        rsa_crt_key_add_prime( key, P[j], D[j], T[j] );
+    }
+    else {
+      rsa_crt_key_set_cached( key, P[0], P[1], D[0], D[1], T[1], cache );
+      for ( size_t j = 2; j < u; j++ )
+        rsa_crt_key_add_prime_cached( key, P[j], D[j], T[j], cache );
+    }
+
+    test_elem( c, state, N );
+    mpz_powm( want, c, d, N );
+
+    opt_parallel_crt = ( i / 2 ) % 2;
+    rsa_crt_decrypt( got, c, key );
+    failed += test_expect( "rsa_crt_decrypt", i, got, want );
+  }
+
+  opt_parallel_crt = parallel_crt;
+  modulus_cache_clear( cache );
+  rsa_crt_key_clear( key );
+  mpz_clear( N );
+  mpz_clear( phi );
+  mpz_clear( e );
+  mpz_clear( d );
+  mpz_clear( c );
+  mpz_clear( got );
+  mpz_clear( want );
+  for ( size_t j = 0; j < RSA_PRIMES_MAX; j++ ) {
+    mpz_clear( P[j] );
+    mpz_clear( D[j] );
+    mpz_clear( T[j] );
+  }
+  return failed;
+}
+
+// ElGamal: stage3's encryption decrypted with elgamal_decrypt_batch, and elgamal_decrypt_batch against
+// c2 * ( c1^x )^-1 computed with mpz_powm and mpz_invert, for full length and short private keys
+int test_elgamal( gmp_randstate_t state ) {
+  int   failed = 0;
+  mpz_t x, k, want[ TEST_BASES ], c1[ TEST_BASES ], c2[ TEST_BASES ];
+  mpz_ptr ms[ TEST_BASES ], c1s[ TEST_BASES ], c2s[ TEST_BASES ];
+  mpz_init( x );
+  mpz_init( k );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_init( want[j] );
+    mpz_init( c1[j] ); c1s[j] = c1[j];
+    mpz_init( c2[j] ); c2s[j] = c2[j];
+    ms[j] = c1[j]; // decrypt in place
+  }
+
+  stage3_challenge_t ch;
+  stage3_state_t     st;
+  _stage3_challenge_init( &ch );
+  _stage3_state_init( &st );
+
+  elgamal_key_t key;
+  elgamal_key_init( key );
+
+  for ( size_t i = 0; i < TEST_CASES / 16; i++ ) {
+    test_group( ch.p, ch.q, ch.g, state );
+
+    // x full length, or short enough that decryption inverts c1^x
+    if ( i % 2 )
+      mpz_urandomm( x, state, ch.q );
+    else
+      mpz_urandomb( x, state, 64 );
+    elgamal_key_set( key, ch.p, ch.q, x );
+
+    size_t n = 1 + i % TEST_BASES;
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( ch.h, ch.g, x, ch.p );
+      mpz_urandomm( ch.m, state, ch.p );
+      mpz_set( want[j], ch.m );
+      _stage3_compute( &ch, &st );
+      mpz_set( c1[j], ch.c1 );
+      mpz_set( c2[j], ch.c2 );
+    }
+    elgamal_decrypt_batch( ms, c1s, c2s, n, key );
+    for ( size_t j = 0; j < n; j++ )
+      failed += test_expect( "elgamal round trip", i, ms[j], want[j] );
+
+    // any c1 in the group, and c2 in Z_p
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_urandomm( k, state, ch.q );
+      mpz_powm( c1[j], ch.g, k, ch.p );
+      mpz_urandomm( c2[j], state, ch.p );
+      mpz_powm( want[j], c1[j], x, ch.p );
+      mpz_invert( want[j], want[j], ch.p );
+      mpz_mul( want[j], want[j], c2[j] );
+      mpz_mod( want[j], want[j], ch.p );
+    }
+    elgamal_decrypt_batch( ms, c1s, c2s, n, key );
+    for ( size_t j = 0; j < n; j++ )
+      failed += test_expect( "elgamal_decrypt_batch", i, ms[j], want[j] );
+  }
+
+  elgamal_key_clear( key );
+  _stage3_state_clear( &st );
+  _stage3_challenge_clear( &ch );
+  mpz_clear( x );
+  mpz_clear( k );
+  for ( size_t j = 0; j < TEST_BASES; j++ ) {
+    mpz_clear( want[j] );
+    mpz_clear( c1[j] );
+    mpz_clear( c2[j] );
+  }
+  return failed;
+}
+
+
+// the precomputed ephemeral keys of stage3, through _stage3_compute: once the queue of a public key has a key ready,
+// the next challenge for it must take that key, and c2 <- m * h^k by a single Montgomery multiplication, and still
+// decrypt. There are more public keys, all in one group, than queues, so queues are evicted and refilled for another
+// key, and the keys being computed for the evicted one are thrown away.
+int test_elgamal_precomp( gmp_randstate_t state ) {
+  int    failed = 0;
+  size_t n      = ELGAMAL_PRECOMP_KEYS + 2, depth = 3;
+  mpz_t  x[ ELGAMAL_PRECOMP_KEYS + 2 ], h, want, last;
+  mpz_init( h );
+  mpz_init( want );
+  mpz_init( last );
+  for ( size_t j = 0; j < n; j++ )
+    mpz_init( x[j] );
+
+  int precompute = opt_precompute;
+  opt_precompute = depth;
+  elgamal_precomp_init( stage3_precomp, depth );
+
+  stage3_challenge_t ch;
+  stage3_state_t     st;
+  _stage3_challenge_init( &ch );
+  _stage3_state_init( &st );
+
+  elgamal_key_t key;
+  elgamal_key_init( key );
+
+  test_group( ch.p, ch.q, ch.g, state );
+  for ( size_t j = 0; j < n; j++ )
+    mpz_urandomm( x[j], state, ch.q );
+
+  // every public key once, evicting the first two, then the first four again, two of which still have their queue
+  for ( size_t i = 0; i < 2 * n; i++ ) {
+    size_t j = ( i < n ) ? i : i % 4;
+    mpz_powm( h, ch.g, x[j], ch.p );
+    elgamal_key_set( key, ch.p, ch.q, x[j] );
+
+    // the first challenge asks for a queue if the key has none, the rest wait for a key in it and must take it
+    for ( size_t t = 0; t <= depth; t++ ) {
+      size_t head = 0, next = 0;
+      int    ready = 0;
+      for ( size_t wait = 0; t > 0 && !ready && wait < 10000; wait++ ) {
+        ready = test_precomp_ready( stage3_precomp, h, &head );
+        if ( !ready )
+          nanosleep( &( struct timespec ) { 0, 1000000 }, NULL );
+      }
+      if ( t > 0 && !ready ) {
+        fprintf( stderr, "elgamal_precomp, case %zu: no key was precomputed\n", i );
+        failed++;
+        continue;
+      }
+
+      mpz_set( ch.h, h );
+      mpz_urandomm( ch.m, state, ch.p );
+      _stage3_compute( &ch, &st );
+      test_precomp_ready( stage3_precomp, h, &next );
+      if ( t > 0 && next != ( head + 1 ) % depth ) {
+        fprintf( stderr, "elgamal_precomp, case %zu: the precomputed key was not taken\n", i );
+        failed++;
+      }
+      if ( t > 0 && mpz_cmp( ch.c1, last ) == 0 ) {
+        fprintf( stderr, "elgamal_precomp, case %zu: an ephemeral key was handed out twice\n", i );
+        failed++;
+      }
+      mpz_set( last, ch.c1 );
+
+      mpz_ptr ms[] = { want }, c1s[] = { ch.c1 }, c2s[] = { ch.c2 };
+      elgamal_decrypt_batch( ms, c1s, c2s, 1, key );
+      failed += test_expect( "elgamal_precomp round trip", i, want, ch.m );
+    }
+  }
+
+  // take the key of the first public key, so the background thread refills its queue, and at once ask for all the
+  // others, which evicts that queue mid refill. The key it was computing must not land in the queue's new owner
+  for ( size_t i = 0; i < 64; i++ ) {
+    size_t head;
+    mpz_powm( h, ch.g, x[0], ch.p );
+    elgamal_precomp_take( stage3_precomp, ch.c1, ch.h, ch.p, ch.q, ch.g, h );
+    for ( size_t wait = 0; !test_precomp_ready( stage3_precomp, h, &head ) && wait < 10000; wait++ )
+      nanosleep( &( struct timespec ) { 0, 1000000 }, NULL );
+    for ( size_t j = 0; j < n; j++ ) {
+      mpz_powm( h, ch.g, x[j], ch.p );
+      elgamal_precomp_take( stage3_precomp, ch.c1, ch.h, ch.p, ch.q, ch.g, h );
+    }
+
+    for ( size_t j = 0; j < n; j++ ) {
+      size_t head;
+      mpz_powm( h, ch.g, x[j], ch.p );
+      if ( !test_precomp_ready( stage3_precomp, h, &head ) )
+        continue;
+
+      elgamal_key_set( key, ch.p, ch.q, x[j] );
+      mpz_set( ch.h, h );
+      mpz_urandomm( ch.m, state, ch.p );
+      _stage3_compute( &ch, &st );
+
+      mpz_ptr ms[] = { want }, c1s[] = { ch.c1 }, c2s[] = { ch.c2 };
+      elgamal_decrypt_batch( ms, c1s, c2s, 1, key );
+      failed += test_expect( "elgamal_precomp after eviction", i, want, ch.m );
+    }
+  }
+
+  elgamal_key_clear( key );
+  _stage3_state_clear( &st );
+  _stage3_challenge_clear( &ch );
+  elgamal_precomp_clear( stage3_precomp );
+  opt_precompute = precompute;
+  mpz_clear( h );
+  mpz_clear( want );
+  mpz_clear( last );
+  for ( size_t j = 0; j < n; j++ )
+    mpz_clear( x[j] );
+  return failed;
+}
+
+// chacha20_block against the all zero key and nonce test vector, and csprng_urandomm stays in range
+int test_csprng( gmp_randstate_t state ) {
+  int failed = 0;
+
+  const unsigned char expect[ 16 ] = { 0x76, 0xB8, 0xE0, 0xAD, 0xA0, 0xF1, 0x3D, 0x90,
+                                       0x40, 0x5D, 0x6A, 0xE5, 0x53, 0x86, 0xBD, 0x28 };
+  const uint32_t      key[ 8 ]     = { 0 };
+  unsigned char       block[ 64 ];
+  chacha20_block( block, key, 0 );
+  if ( memcmp( block, expect, sizeof( expect ) ) != 0 ) {
+    fprintf( stderr, "chacha20_block: wrong keystream for the zero key\n" );
+    failed++;
+  }
+
+  mpz_t q, k;
+  mpz_init( q );
+  mpz_init( k );
+  csprng_t rng;
+  csprng_init( rng );
+
+  for ( size_t i = 0; i < TEST_CASES; i++ ) {
+    mpz_urandomb( q, state, 1 + gmp_urandomm_ui( state, 1024 ) );
+    mpz_add_ui( q, q, 1 );
+    csprng_urandomm( k, rng, q );
+    if ( mpz_sgn( k ) < 0 || mpz_cmp( k, q ) >= 0 ) {
+      gmp_fprintf( stderr, "csprng_urandomm, case %zu: %ZX is not below %ZX\n", i, k, q );
+      failed++;
+    }
+  }
+
+  csprng_clear( rng );
+  mpz_clear( q );
+  mpz_clear( k );
+  return failed;
 }
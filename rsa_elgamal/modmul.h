@@ -13,42 +13,850 @@
 
 #include        <math.h>
 #include      <limits.h>
+#include       <ctype.h>
+#include      <unistd.h>
+#include       <errno.h>
+#include      <stdint.h>
+#include  <sys/random.h>
 
 #include      <string.h>
+#include        <time.h>
+#include     <pthread.h>
 #include         <gmp.h>
 
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include   <x86intrin.h>
+#endif
+
+
+// options
+extern int    opt_parallel_crt;
+extern int    opt_simd;
+extern size_t opt_threads;
+extern size_t opt_batch;
+extern size_t opt_precompute;
+extern size_t opt_primes;
+extern size_t opt_cache;
+extern int    opt_cache_stats;
+
+
+// thread pool
+typedef struct thread_pool_s thread_pool_t;
+
+typedef struct {
+  thread_pool_t * pool;
+  size_t          worker; // index of the worker, from 1 as worker 0 is the caller of thread_pool_run
+  pthread_t       thread;
+} thread_pool_worker_t;
+
+struct thread_pool_s {
+  thread_pool_worker_t * workers;
+  size_t                 n;       // number of workers, including the caller of thread_pool_run
+  pthread_mutex_t        lock;
+  pthread_cond_t         start;   // signalled when a new round starts or the pool stops
+  pthread_cond_t         done;    // signalled when the last thread finishes a round
+  void                ( * run )( void * arg, size_t worker );
+  void                 * arg;
+  unsigned long          round;   // incremented by every thread_pool_run
+  size_t                 running; // number of threads still working on the current round
+  int                    stop;
+};
+
+void thread_pool_init( thread_pool_t * pool, size_t n );
+
+void thread_pool_run( thread_pool_t * pool, void ( * run )( void * arg, size_t worker ), void * arg );
+
+void thread_pool_clear( thread_pool_t * pool );
+
+void * _thread_pool_worker( void * worker );
+
+
+// challenge input and output
+typedef struct {
+  FILE * in;
+  char * buf;        // lines are read into and parsed in place in buf
+  size_t size;       // the size of buf
+  size_t start, end; // the unread part of buf
+  int    eof;        // set once in has run out
+  int    line;       // number of lines read so far
+} hex_reader_t;
+
+extern const unsigned char hex_value[ 256 ];
+
+void hex_reader_init( hex_reader_t * rd, FILE * in );
+
+void hex_reader_clear( hex_reader_t * rd );
+
+char * hex_reader_line( hex_reader_t * rd, size_t * len );
+
+int hex_reader_next( hex_reader_t * rd, mpz_t r );
+
+typedef struct {
+  FILE * out;
+  char * buf;  // lines are formatted straight into buf, then written out a block at a time
+  size_t size; // the size of buf
+  size_t end;  // the used part of buf
+  int    tty;  // set if out is a terminal, so should be flushed more eagerly
+} hex_writer_t;
+
+void hex_writer_init( hex_writer_t * wr, FILE * out );
+
+void hex_writer_clear( hex_writer_t * wr );
+
+void hex_writer_flush( hex_writer_t * wr );
+
+void hex_writer_put( hex_writer_t * wr, const mpz_t r );
+
+
+// stages: each is a set of callbacks run by stage_run. A challenge holds both the inputs and result of one tuple;
+// the state is owned by a single worker, e.g. its Montgomery contexts
+typedef struct {
+  size_t challenge_size;
+  size_t state_size;
+  void ( * challenge_init  )( void * challenge );
+  void ( * challenge_clear )( void * challenge );
+  void ( * state_init      )( void * state );
+  void ( * state_clear     )( void * state );
+  int  ( * read            )( void * challenge, hex_reader_t * in ); // 0 if there are no more challenges
+  void ( * compute         )( void * challenge, void * state );
+  void ( * write           )( void * challenge, hex_writer_t * out );
+  void ( * compute_run     )( void * challenges, size_t n, void * state ); // optional, n consecutive challenges
+} stage_t;
+
+#define STAGE_RUN_SIZE 16 // max number of challenges passed to compute_run at once
+
+// a batch of challenges being computed by a thread pool
+typedef struct {
+  const stage_t * stage;
+  char          * challenges;
+  char          * states;
+  size_t          n;
+  size_t          next; // the next challenge for a worker to take
+} stage_batch_t;
+
+void stage_run( const stage_t * stage );
+
+void _stage_batch_run( void * batch, size_t worker );
+
+int _stage_read_fields( hex_reader_t * in, mpz_ptr * fields, int n );
+
 
 // helpers for stage1-4
-int _stage1_read_challenge( char ** N_str, char ** e_str, char ** m_str, size_t * line_size );
+typedef struct { mpz_t N, e, m, c; } stage1_challenge_t;
+
+extern const stage_t stage1_def;
+
+void _stage1_challenge_init( void * challenge );
+
+void _stage1_challenge_clear( void * challenge );
+
+void _stage1_state_init( void * state );
+
+void _stage1_state_clear( void * state );
+
+int  _stage1_read( void * challenge, hex_reader_t * in );
+
+void _stage1_compute( void * challenge, void * state );
+
+void _stage1_compute_run( void * challenges, size_t n, void * state );
+
+void _stage1_write( void * challenge, hex_writer_t * out );
+
+
+#define RSA_PRIMES_MAX 4                      // max number of primes of a multi-prime RSA key, see --primes
+#define RSA_OTHERS_MAX ( RSA_PRIMES_MAX - 2 ) // max number of primes after p and q
+
+typedef struct {
+  mpz_t N, d, p, q, d_p, d_q, i_p, i_q, c, m;
+  mpz_t r[ RSA_OTHERS_MAX ], d_r[ RSA_OTHERS_MAX ], t[ RSA_OTHERS_MAX ]; // the primes after q, with --primes
+} stage2_challenge_t;
+
+extern const stage_t stage2_def;
+
+void _stage2_challenge_init( void * challenge );
+
+void _stage2_challenge_clear( void * challenge );
+
+void _stage2_state_init( void * state );
+
+void _stage2_state_clear( void * state );
+
+int  _stage2_read( void * challenge, hex_reader_t * in );
+
+void _stage2_compute( void * challenge, void * state );
+
+void _stage2_compute_run( void * challenges, size_t n, void * state );
+
+void _stage2_write( void * challenge, hex_writer_t * out );
+
+
+typedef struct { mpz_t p, q, g, h, m, c1, c2; } stage3_challenge_t;
+
+extern const stage_t stage3_def;
+
+void _stage3_challenge_init( void * challenge );
+
+void _stage3_challenge_clear( void * challenge );
+
+void _stage3_state_init( void * state );
+
+void _stage3_state_clear( void * state );
+
+int  _stage3_read( void * challenge, hex_reader_t * in );
+
+void _stage3_compute( void * challenge, void * state );
+
+void _stage3_write( void * challenge, hex_writer_t * out );
+
+
+typedef struct { mpz_t p, q, g, x, c1, c2, m; } stage4_challenge_t;
+
+extern const stage_t stage4_def;
+
+void _stage4_challenge_init( void * challenge );
+
+void _stage4_challenge_clear( void * challenge );
+
+int  _stage4_read( void * challenge, hex_reader_t * in );
 
-int _stage2_read_challenge( char ** N_str, char ** d_str, char ** p_str, char ** q_str, char ** d_p_str,
-                             char ** d_q_str, char ** i_p_str, char ** i_q_str, char ** c_str,
-                             size_t * line_size );
+void _stage4_state_init( void * state );
 
-int _stage3_read_challenge( char ** p_str, char ** q_str, char ** g_str, char ** h_str, char ** m_str,
-                            size_t * line_size );
+void _stage4_state_clear( void * state );
 
-int _stage4_read_challenge( char ** p_str, char ** q_str, char ** g_str, char ** x_str, char ** c1_str,
-                            char ** c2_str, size_t * line_size );
+void _stage4_compute( void * challenge, void * state );
+
+void _stage4_compute_run( void * challenges, size_t n, void * state );
+
+void _stage4_write( void * challenge, hex_writer_t * out );
 
 
 // csprng
-void get_random_seed( mpz_t seed );
+#define CSPRNG_BUFFER_SIZE    4096 // bytes of ChaCha20 keystream generated per refill, a multiple of 64
+#define CSPRNG_RESEED_REFILLS 4096 // refills between reseeds from the kernel, i.e. every 16 MiB of output
+
+typedef struct {
+  uint32_t      key[ 8 ];                  // the ChaCha20 key, replaced on every refill
+  unsigned char buf[ CSPRNG_BUFFER_SIZE ]; // keystream, handed out from buf[pos] on
+  size_t        pos;
+  size_t        refills;                   // number of refills since the last reseed
+} csprng_struct;
+
+typedef csprng_struct csprng_t[ 1 ];
+
+void chacha20_block( unsigned char * out, const uint32_t * key, uint64_t counter );
+
+void get_random_bytes( unsigned char * out, size_t n );
+
+void csprng_init( csprng_t rng );
+
+void csprng_clear( csprng_t rng );
+
+void csprng_reseed( csprng_t rng );
+
+void csprng_refill( csprng_t rng );
+
+void csprng_bytes( csprng_t rng, unsigned char * out, size_t n );
+
+void csprng_urandomm( mpz_t r, csprng_t rng, mpz_t q );
 
 
 // sliding window exponentiation
+mp_bitcnt_t sliding_window_size( mpz_t e );
+
 void sliding_window_expm( mpz_t r, mpz_t b, mpz_t e, mpz_t N );
 
+void sliding_window_expm_k( mpz_t r, mpz_t b, mpz_t e, mpz_t N, mp_bitcnt_t k );
+
 void sliding_window_expm_precompute_T( mpz_t * T, size_t n, mpz_t b, mpz_t N, mp_bitcnt_t k );
 
+int sliding_window_next( mpz_t e, int i, int * l, mp_bitcnt_t k );
+
+// an exponent recoded into its sliding windows once, so ladders that reuse it replay the windows rather than find
+// them again bit by bit
+typedef struct {
+  uint32_t digit; // the odd value u of the window, the accumulator is multiplied by b^u
+  uint32_t shift; // the squarings before the multiplication: the width of the window and the 0s above it
+} expm_step_t;
+
+typedef struct {
+  mpz_t         e;     // the exponent recoded
+  mp_bitcnt_t   k;     // the max window size, or 0 if no exponent has been recoded
+  expm_step_t * steps; // the windows from the most significant, the first sets the accumulator so has no squarings
+  size_t        n;     // number of steps, 0 if e = 0
+  size_t        size;  // number of steps allocated
+  mp_bitcnt_t   tail;  // squarings after the last step, for the 0s below the last window
+  size_t        T_n;   // number of odd powers of the base the steps use, b^1, b^3, ..., b^(2 * T_n - 1)
+} expm_schedule_struct;
+
+typedef expm_schedule_struct expm_schedule_t[ 1 ];
+
+void expm_schedule_init( expm_schedule_t s );
+
+void expm_schedule_set( expm_schedule_t s, mpz_t e, mp_bitcnt_t k );
+
+void expm_schedule_clear( expm_schedule_t s );
+
+size_t expm_schedule_cost( expm_schedule_t s );
+
+mp_limb_t _expm_schedule_bits( const mp_limb_t * e, size_t e_n, mp_bitcnt_t lo, mp_bitcnt_t w );
+
+// integer pool: a stack of initialised integers, lent out and put back so their limbs are reused
+typedef struct {
+  mpz_ptr * z;    // z[0..used-1] are lent out, z[used..n-1] are free
+  size_t    n;    // number of integers in the pool
+  size_t    used; // number lent out
+} mpz_pool_struct;
+
+typedef mpz_pool_struct mpz_pool_t[ 1 ];
+
+void mpz_pool_init( mpz_pool_t pool );
+
+void mpz_pool_clear( mpz_pool_t pool );
+
+void mpz_pool_get( mpz_pool_t pool, mpz_ptr * z, size_t n );
+
+void mpz_pool_put( mpz_pool_t pool, size_t n );
+
 // Montgomery multiplication
+typedef void ( * montmul_limbs_fn )( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * y, const mp_limb_t * N,
+                                     size_t l_N, mp_limb_t omega, mp_limb_t * scratch );
+typedef void ( * montsqr_limbs_fn )( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, size_t l_N,
+                                     mp_limb_t omega, mp_limb_t * scratch );
+
+typedef struct {
+  size_t           l_N;    // the number of limbs the kernels are specialised for
+  montmul_limbs_fn montmul;
+  montsqr_limbs_fn montsqr;
+} montgomery_kernel_t;
+
+extern const montgomery_kernel_t montgomery_kernels[];
+
+typedef struct {
+  mpz_t            N;        // the modulus, must be odd
+  size_t           l_N;      // number of limbs in N
+  mp_limb_t        omega;    // -N^-1 mod b, where b = 2^mp_bits_per_limb is the base
+  mpz_t            rho_sqrd; // rho^2 mod N, where rho = b^l_N
+  montmul_limbs_fn montmul;  // the limb-level kernels for l_N limbs, picked from montgomery_kernels
+  montsqr_limbs_fn montsqr;
+  mp_limb_t *      scratch;  // limb buffers reused by every Z_N_montmul
+  mpz_pool_t       pool;     // temporaries and tables of the exponentiations done with this context
+  int *            windows;  // window values reused by multi_expm_mont
+  size_t           windows_n;
+  expm_schedule_t  sched;    // the windows of the last exponent recoded for N
+} montgomery_ctx_struct;
+
+typedef montgomery_ctx_struct montgomery_ctx_t[ 1 ];
+
+void montgomery_ctx_init( montgomery_ctx_t ctx );
+
+void montgomery_ctx_set( montgomery_ctx_t ctx, mpz_t N );
+
+void montgomery_ctx_clear( montgomery_ctx_t ctx );
+
+void montgomery_to( mpz_t x_hat, mpz_t x, montgomery_ctx_t ctx );
+
+void montgomery_from( mpz_t x, mpz_t x_hat, montgomery_ctx_t ctx );
+
+void mulm_ctx( mpz_t r, mpz_t x, mpz_t y, montgomery_ctx_t ctx );
+
 void mulm( mpz_t r, mpz_t x, mpz_t y, mpz_t N );
 
-void Z_N_montmul( mpz_t r, mpz_t x, mpz_t y, mpz_t N, size_t l_N, mpz_t omega, size_t omega_N );
+void Z_N_montmul( mpz_t r, mpz_t x, mpz_t y, montgomery_ctx_t ctx );
+
+void Z_N_montmul_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * y, const mp_limb_t * N,
+                        size_t l_N, mp_limb_t omega, mp_limb_t * scratch );
+
+void Z_N_montsqr( mpz_t r, mpz_t x, montgomery_ctx_t ctx );
+
+void Z_N_montsqr_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, size_t l_N, mp_limb_t omega,
+                        mp_limb_t * scratch );
+
+#define Z_N_MONT_LIMBS_DECL( L )                                                                                     \
+void Z_N_montmul_limbs_##L( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * y, const mp_limb_t * N,           \
+                            size_t l_N, mp_limb_t omega, mp_limb_t * scratch );                                     \
+void Z_N_montsqr_limbs_##L( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, size_t l_N, mp_limb_t omega,   \
+                            mp_limb_t * scratch );
+
+Z_N_MONT_LIMBS_DECL( 8  )
+Z_N_MONT_LIMBS_DECL( 16 )
+Z_N_MONT_LIMBS_DECL( 32 )
+Z_N_MONT_LIMBS_DECL( 64 )
+
+int invertm_batch( mpz_ptr * r, mpz_ptr * x, size_t n, montgomery_ctx_t ctx );
+
+// Barrett reduction
+typedef struct {
+  mpz_t       N;       // the modulus
+  size_t      l_N;     // number of limbs in N
+  mpz_t       mu;      // floor( b^(2*l_N) / N ), where b = 2^mp_bits_per_limb is the base
+  mp_limb_t * scratch; // limb buffers reused by every reduction
+  mpz_pool_t  pool;    // temporaries and tables of the exponentiations done with this context
+} barrett_ctx_struct;
+
+typedef barrett_ctx_struct barrett_ctx_t[ 1 ];
+
+void barrett_ctx_init( barrett_ctx_t ctx );
+
+void barrett_ctx_set( barrett_ctx_t ctx, mpz_t N );
+
+void barrett_ctx_clear( barrett_ctx_t ctx );
+
+void barrett_reduce_limbs( mp_limb_t * r, const mp_limb_t * x, const mp_limb_t * N, const mp_limb_t * mu,
+                           size_t l_N, mp_limb_t * scratch );
+
+void barrett_reduce( mpz_t r, mpz_t x, barrett_ctx_t ctx );
+
+void mulm_barrett( mpz_t r, mpz_t x, mpz_t y, barrett_ctx_t ctx );
+
+void sqrm_barrett( mpz_t r, mpz_t x, barrett_ctx_t ctx );
+
+void _barrett_reduce_finish( mpz_t r, barrett_ctx_t ctx );
+
+void sliding_window_expm_barrett( mpz_t r, mpz_t b, mpz_t e, barrett_ctx_t ctx );
+
+void sliding_window_expm_barrett_k( mpz_t r, mpz_t b, mpz_t e, barrett_ctx_t ctx, mp_bitcnt_t k );
+
+// sliding window exponentiation in Montgomery representation
+void sliding_window_expm_mont( mpz_t r, mpz_t b, mpz_t e, montgomery_ctx_t ctx );
+
+void sliding_window_expm_mont_k( mpz_t r, mpz_t b, mpz_t e, montgomery_ctx_t ctx, mp_bitcnt_t k );
+
+void sliding_window_expm_mont_sched( mpz_t r, mpz_t b, expm_schedule_t s, montgomery_ctx_t ctx );
+
+void sliding_window_expm_mont_precompute_T( mpz_ptr * T, size_t n, mpz_t b, montgomery_ctx_t ctx );
+
+// an exponentiation r <- b^e mod N that can be run on another thread
+typedef struct {
+  mpz_ptr                 r, b;
+  expm_schedule_struct  * e;
+  montgomery_ctx_struct * ctx;
+} expm_job_t;
+
+// n independent exponentiations, spread over the workers of a thread_pool
+typedef struct {
+  expm_job_t * jobs;
+  size_t       n, workers; // number of jobs, and of workers they are spread over
+} expm_jobs_t;
+
+void expm_jobs_run( void * jobs, size_t worker );
+
+// per-modulus context cache, defined below
+typedef struct modulus_cache_s modulus_cache_struct;
+
+// RSA-CRT decryption, for keys of two primes p and q, or of up to RSA_PRIMES_MAX with the others r_3, ... after them
+typedef struct {
+  mpz_t                   p, q;                    // the primes, N = p * q * r_3 ...
+  mpz_t                   d_p, d_q;                // the private exponent mod p-1 and q-1
+  mpz_t                   i_q;                     // the Garner coefficient q^-1 mod p
+  montgomery_ctx_struct * p_ctx, * q_ctx;          // Montgomery params for p and q, the key's own or a cache's,
+                                                   // with the windows of d_p and d_q in their sched
+  barrett_ctx_struct    * p_barrett;               // Barrett params for p, for the recombination
+  montgomery_ctx_t        own_p_ctx, own_q_ctx;
+  barrett_ctx_t           own_p_barrett;
+  size_t                  u;                       // number of primes, 2 <= u <= RSA_PRIMES_MAX
+  mpz_t                   r[ RSA_OTHERS_MAX ];     // the other primes r_i, for 3 <= i <= u, at r[ i - 3 ]
+  mpz_t                   d_r[ RSA_OTHERS_MAX ];   // the private exponent mod r_i - 1
+  mpz_t                   t[ RSA_OTHERS_MAX ];     // the Garner coefficient ( p * q * ... r_(i-1) )^-1 mod r_i
+  mpz_t                   R[ RSA_OTHERS_MAX ];     // the product p * q * ... r_(i-1)
+  montgomery_ctx_struct * r_ctx[ RSA_OTHERS_MAX ]; // as p_ctx and p_barrett, for r_i
+  barrett_ctx_struct    * r_barrett[ RSA_OTHERS_MAX ];
+  montgomery_ctx_t        own_r_ctx[ RSA_OTHERS_MAX ];
+  barrett_ctx_t           own_r_barrett[ RSA_OTHERS_MAX ];
+  thread_pool_t           pool;                    // with --parallel-crt, a worker per prime for the halves, started
+  size_t                  pool_n;                  // by the first decryption for keys of pool_n primes, else 0
+} rsa_crt_key_struct;
+
+typedef rsa_crt_key_struct rsa_crt_key_t[ 1 ];
+
+void rsa_crt_key_init( rsa_crt_key_t key );
+
+void rsa_crt_key_set( rsa_crt_key_t key, mpz_t p, mpz_t q, mpz_t d_p, mpz_t d_q, mpz_t i_q );
+
+void rsa_crt_key_set_cached( rsa_crt_key_t key, mpz_t p, mpz_t q, mpz_t d_p, mpz_t d_q, mpz_t i_q,
+                             modulus_cache_struct * cache );
+
+void rsa_crt_key_add_prime( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t );
+
+void rsa_crt_key_add_prime_cached( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t, modulus_cache_struct * cache );
+
+void _rsa_crt_key_add_prime( rsa_crt_key_t key, mpz_t r, mpz_t d_r, mpz_t t );
+
+void rsa_crt_key_clear( rsa_crt_key_t key );
+
+void rsa_crt_decrypt( mpz_t m, mpz_t c, rsa_crt_key_t key );
+
+void rsa_crt_recombine( mpz_t m, mpz_ptr m_p, mpz_ptr m_q, mpz_ptr * m_r, rsa_crt_key_t key );
+
+// ElGamal decryption
+#define ELGAMAL_INVERT_COST 16 // an mpz_invert mod p, in Montgomery multiplications: 21 at 512 bits to 6 at 4096
+
+typedef struct {
+  mpz_t            p, q, x; // the private key x of the group of order q in Z_p^*
+  mpz_t            e;       // -x mod q, the exponent that decrypts
+  expm_schedule_t  e_sched; // the windows of e, with e_sched->k = 0 if no key is set
+  expm_schedule_t  x_sched; // the windows of x
+  size_t           e_cost;  // the costs of replaying e_sched and x_sched, from expm_schedule_cost
+  size_t           x_cost;
+  montgomery_ctx_t p_ctx;
+} elgamal_key_struct;
+
+typedef elgamal_key_struct elgamal_key_t[ 1 ];
+
+void elgamal_key_init( elgamal_key_t key );
+
+void elgamal_key_set( elgamal_key_t key, mpz_t p, mpz_t q, mpz_t x );
+
+void elgamal_key_clear( elgamal_key_t key );
+
+void elgamal_decrypt( mpz_t m, mpz_t c1, mpz_t c2, elgamal_key_t key );
+
+void elgamal_decrypt_batch( mpz_ptr * m, mpz_ptr * c1, mpz_ptr * c2, size_t n, elgamal_key_t key );
+
+int _elgamal_decrypt_batch_invert( mpz_ptr * m, mpz_ptr * c1, mpz_ptr * c2, size_t n, elgamal_key_t key );
+
+
+// simultaneous exponentiation
+void multi_expm_mont( mpz_t r, mpz_ptr * b, mpz_ptr * e, size_t n, montgomery_ctx_t ctx );
+
+void sliding_window_expm_mont_n( mpz_ptr * r, mpz_ptr * b, size_t n, mpz_t e, montgomery_ctx_t ctx );
+
+void sliding_window_expm_mont_mul_n( mpz_ptr * r, mpz_ptr * b, mpz_ptr * y, size_t n, mpz_t e, montgomery_ctx_t ctx,
+                                     mp_bitcnt_t k );
+
+void sliding_window_expm_mont_mul_n_sched( mpz_ptr * r, mpz_ptr * b, mpz_ptr * y, size_t n, expm_schedule_t s,
+                                           montgomery_ctx_t ctx );
+
+// multi-buffer exponentiation: MB_LANES independent exponentiations, one per 64-bit lane of the vector registers.
+// Values are held in radix 2^52, with digit j of lane l at [ j * MB_LANES + l ], i.e. one vector per digit.
+#if defined( __x86_64__ ) && defined( __GNUC__ ) && GMP_NUMB_BITS == 64
+#define MB_SIMD 1
+#else
+#define MB_SIMD 0
+#endif
+
+#define MB_LANES      8    // exponentiations per batch, as 64-bit lanes of a 512-bit register
+#define MB_DIGIT_BITS 52   // bits per digit, the width of the AVX-512 IFMA multipliers
+#define MB_DIGIT_MASK ( ( (uint64_t) 1 << MB_DIGIT_BITS ) - 1 )
+#define MB_WINDOW_MAX 6    // max fixed window size
+#define MB_MAX_BITS   4096 // max modulus length, longer moduli are left to the scalar exponentiation
+#define MB_MIN_LANES  2    // min number of exponentiations worth a multi-buffer batch
+
+typedef struct {
+  size_t                 size;           // number of digits the buffers are sized for
+  uint64_t *             N;              // the moduli, n digits
+  uint64_t *             rho_sqrd;       // rho^2 mod N, where rho = 2^(52 * n)
+  uint64_t *             T;              // the window table, 2^MB_WINDOW_MAX values
+  uint64_t *             acc, * t;       // the accumulator, and the multiplicand of each step
+  uint64_t *             scratch;        // 2 * n + 2 digits for _mb_montmul
+  uint64_t               k0[ MB_LANES ]; // -N^-1 mod 2^52
+  int                    w[ MB_LANES ];  // the current window of each exponent
+  mpz_t                  tmp;
+  montgomery_ctx_t       fallback;       // for exponentiations done one at a time
+  modulus_cache_struct * cache;          // keeps the params of each modulus for reuse, or NULL to recompute them
+} mb_ctx_struct;
+
+typedef mb_ctx_struct mb_ctx_t[ 1 ];
+
+int mb_available( void );
+
+void mb_ctx_init( mb_ctx_t ctx );
+
+void mb_ctx_clear( mb_ctx_t ctx );
+
+void mb_expm( mpz_ptr * r, mpz_ptr * b, mpz_ptr * e, mpz_ptr * N, size_t n, mb_ctx_t ctx );
+
+mp_bitcnt_t mb_window_size( mp_bitcnt_t bits );
+
+void _mb_ctx_size( mb_ctx_t ctx, size_t n );
+
+void _mb_set_ui( uint64_t * x, unsigned long a, size_t n );
+
+void _mb_params( uint64_t * k0, mpz_t rho_sqrd, mpz_t N, size_t n );
+
+void _mb_from_mpz( uint64_t * x, size_t l, mpz_t a, size_t n );
+
+void _mb_to_mpz( mpz_t a, const uint64_t * x, size_t l, size_t n );
+
+void _mb_montmul( uint64_t * r, const uint64_t * x, const uint64_t * y, const uint64_t * N, const uint64_t * k0,
+                  size_t n, uint64_t * scratch );
+
+void _mb_gather( uint64_t * r, const uint64_t * T, const int * w, size_t n );
+
+// fixed-base exponentiation
+typedef struct {
+  mpz_t            g;         // the base, reduced mod p
+  montgomery_ctx_t ctx;       // Montgomery params for the modulus p
+  barrett_ctx_t    p_barrett; // Barrett params for p, only set if used for one-off products
+  mp_bitcnt_t      a;         // the comb width, exponents of up to fb_teeth * a bits are supported
+  mpz_t *          G;         // the comb table of 2^fb_teeth entries in Montgomery representation, or NULL
+} fixed_base_struct;
+
+typedef fixed_base_struct fixed_base_t[ 1 ];
+
+void fixed_base_init( fixed_base_t fb );
+
+void fixed_base_set( fixed_base_t fb, mpz_t g, mpz_t p );
+
+void fixed_base_free_table( fixed_base_t fb );
+
+void fixed_base_clear( fixed_base_t fb );
+
+void fixed_base_precompute( fixed_base_t fb, mp_bitcnt_t bits );
+
+void fixed_base_expm( mpz_t r, mpz_t e, fixed_base_t fb );
+
+// per-modulus context cache: an LRU of everything computed for a modulus, keyed by a hash of the modulus
+#define MODULUS_CACHE_BUCKETS 256            // hash table size, a power of 2
+#define MODULUS_CACHE_KEEP    RSA_PRIMES_MAX // the most recently used entries, which are kept whatever the budget
+
+typedef struct modulus_s modulus_struct;
+
+struct modulus_s {
+  uint64_t                hash;        // modulus_hash of N, and then of g for an entry with a base
+  int                     has_base;    // set if the entry is for the base g mod N, rather than N alone
+  fixed_base_t            fb;          // the base g with its comb table, and the storage of ctx and bar
+  montgomery_ctx_struct * ctx;         // fb->ctx, the modulus N = ctx->N with its Montgomery params once set
+  barrett_ctx_struct    * bar;         // fb->p_barrett, the Barrett params of N once set
+  size_t                  mb_n;        // the number of radix 2^52 digits the multi-buffer params are for, or 0
+  uint64_t                mb_k0;       // -N^-1 mod 2^52
+  mpz_t                   mb_rho_sqrd; // 2^(2 * 52 * mb_n) mod N
+  size_t                  bytes;       // the memory held by the entry, as counted against the budget
+  modulus_struct        * next;        // the next entry in the same hash bucket
+  modulus_struct        * newer, * older;
+};
+
+typedef struct {
+  unsigned long hits, misses, evictions;
+} modulus_cache_stats_t;
+
+struct modulus_cache_s {
+  modulus_struct *      buckets[ MODULUS_CACHE_BUCKETS ];
+  modulus_struct *      newest, * oldest; // the entries from most to least recently used
+  size_t                n;                // number of entries
+  size_t                bytes;            // the memory held by all entries
+  size_t                budget;           // max bytes, beyond which least recently used entries are evicted
+  modulus_cache_stats_t stats;
+};
+
+typedef modulus_cache_struct modulus_cache_t[ 1 ];
+
+extern modulus_cache_stats_t modulus_cache_totals;
+
+void modulus_cache_init( modulus_cache_t cache, size_t budget );
+
+void modulus_cache_clear( modulus_cache_t cache );
+
+uint64_t modulus_hash( mpz_t x, uint64_t h );
+
+modulus_struct * modulus_cache_get( modulus_cache_t cache, mpz_t N );
+
+modulus_struct * modulus_cache_get_base( modulus_cache_t cache, mpz_t g, mpz_t p, mp_bitcnt_t bits );
+
+montgomery_ctx_struct * modulus_montgomery( modulus_cache_t cache, modulus_struct * mod );
+
+expm_schedule_struct * modulus_schedule( modulus_cache_t cache, modulus_struct * mod, mpz_t e );
+
+barrett_ctx_struct * modulus_barrett( modulus_cache_t cache, modulus_struct * mod );
+
+void modulus_mb_params( modulus_cache_t cache, modulus_struct * mod, size_t n );
+
+modulus_struct * _modulus_cache_find( modulus_cache_t cache, uint64_t hash, mpz_t N, mpz_t g );
+
+modulus_struct * _modulus_cache_insert( modulus_cache_t cache, uint64_t hash, mpz_t N, mpz_t g );
+
+void _modulus_cache_touch( modulus_cache_t cache, modulus_struct * mod );
+
+void _modulus_cache_unlink( modulus_cache_t cache, modulus_struct * mod );
+
+void _modulus_cache_account( modulus_cache_t cache, modulus_struct * mod );
+
+void _modulus_cache_remove( modulus_cache_t cache, modulus_struct * mod );
+
+size_t _modulus_bytes( modulus_struct * mod );
+
+// per-worker state of stage1
+typedef struct {
+  mb_ctx_t        mb;
+  modulus_cache_t cache; // the params of recently seen moduli N
+} stage1_state_t;
+
+// per-worker state of stage2
+typedef struct {
+  rsa_crt_key_t   key;           // the key of the challenge being computed or recombined
+  mb_ctx_t        mb;
+  mpz_t           x[ MB_LANES ]; // the CRT halves of the decryptions computed together
+  modulus_cache_t cache;         // the params of recently seen primes
+} stage2_state_t;
+
+void _stage2_key_set( stage2_challenge_t * ch, stage2_state_t * st );
+
+
+// ElGamal precomputation
+#define ELGAMAL_PRECOMP_KEYS 16 // max number of public keys with a queue of precomputed ephemeral keys
+
+typedef struct {
+  mpz_t   p, q, g, h; // the public key
+  mpz_t * c1;         // ring of depth precomputed g^k mod p, the queue is c1[head..head+count-1]
+  mpz_t * s;          // and the matching h^k mod p, in Montgomery representation
+  size_t  head, count;
+  size_t  used;       // when the queue was last asked for a key, for LRU eviction
+  size_t  gen;        // bumped whenever the queue is given to another public key
+} elgamal_queue_struct;
+
+typedef struct {
+  elgamal_queue_struct queues[ ELGAMAL_PRECOMP_KEYS ];
+  size_t               n, depth, clock;
+
+  // owned by the background thread
+  fixed_base_t         g_fb[ ELGAMAL_PRECOMP_KEYS ], h_fb[ ELGAMAL_PRECOMP_KEYS ]; // comb tables for each queue
+  mpz_t                fb_q[ ELGAMAL_PRECOMP_KEYS ];                             // and the q they were built for
+  size_t               fb_gen[ ELGAMAL_PRECOMP_KEYS ];                           // the gen they were built for
+  csprng_t             rng;
+  mpz_t                k, c1, s;
+
+  pthread_mutex_t      lock;
+  pthread_cond_t       wake; // signalled when a key is taken or on stop
+  pthread_t            thread;
+  int                  stop;
+} elgamal_precomp_struct;
+
+typedef elgamal_precomp_struct elgamal_precomp_t[ 1 ];
+
+extern elgamal_precomp_t stage3_precomp;
+
+void elgamal_precomp_init( elgamal_precomp_t pc, size_t depth );
+
+void elgamal_precomp_clear( elgamal_precomp_t pc );
+
+int elgamal_precomp_take( elgamal_precomp_t pc, mpz_t c1, mpz_t s, mpz_t p, mpz_t q, mpz_t g, mpz_t h );
+
+void * _elgamal_precomp_run( void * arg );
+
+// per-worker state of stage3
+typedef struct {
+  csprng_t        rng;   // the CSPRNG for ephemeral keys
+  modulus_cache_t cache; // comb tables and Montgomery and Barrett params for recently seen groups
+  mpz_t           k;     // the ephemeral key
+} stage3_state_t;
+
+
+// benchmarks
+double bench_seconds();
+
+uint64_t bench_cycles();
+
+#define BENCH_RUN_SECONDS 0.02 // how long each timed run of a primitive lasts
+#define BENCH_REPEATS     5    // number of timed runs of each primitive, after one warm-up run
+
+typedef struct {
+  mpz_t            N, x, y, e, r;
+  mpz_t            xy;    // x * y, to time reductions alone
+  montgomery_ctx_t ctx;
+  barrett_ctx_t    b_ctx;
+  expm_schedule_t  sched; // the windows of e, to time recoding alone
+} bench_args_t;
+
+typedef struct {
+  const char * name;
+  void ( * fn )( bench_args_t * a );
+  const char * ref; // the name of the primitive to compare against, usually GMP's, or NULL for a reference
+} bench_t;
+
+extern const bench_t benches[];
+
+void _bench_gmp_mul_mod( bench_args_t * a );
+
+void _bench_mulm( bench_args_t * a );
+
+void _bench_mulm_ctx( bench_args_t * a );
+
+void _bench_montmul( bench_args_t * a );
+
+void _bench_montsqr( bench_args_t * a );
+
+void _bench_gmp_powm( bench_args_t * a );
+
+void _bench_expm( bench_args_t * a );
+
+void _bench_expm_mont( bench_args_t * a );
+
+void _bench_gmp_mod( bench_args_t * a );
+
+void _bench_barrett( bench_args_t * a );
+
+void _bench_mulm_barrett( bench_args_t * a );
+
+void _bench_mulm_barrett_once( bench_args_t * a );
+
+void _bench_sqrm_barrett( bench_args_t * a );
+
+void _bench_expm_barrett( bench_args_t * a );
+
+void _bench_sliding_window_next( bench_args_t * a );
+
+void _bench_schedule_set( bench_args_t * a );
+
+void _bench_expm_mont_recode( bench_args_t * a );
+
+void bench_time( const bench_t * bench, bench_args_t * a, double * ns, double * ns_min, double * cycles );
+
+void bench_run();
+
+
+// tests
+#define TEST_SEED   20170301 // the tests are randomised, but repeatable
+#define TEST_CASES  256      // number of random cases per test, fewer for the expensive ones
+#define TEST_BASES  6        // max number of bases, ciphertexts etc in a batch
+#define TEST_MODULI 12       // number of distinct moduli looked up in a modulus_cache_t
+
+typedef struct {
+  const char * name;
+  int ( * fn )( gmp_randstate_t state ); // returns the number of failed cases
+} test_case_t;
+
+extern const test_case_t test_cases[];
+
+int test_run( const char * name, int ( * fn )( gmp_randstate_t state ) );
+
+int test_expect( const char * what, size_t i, mpz_t got, mpz_t want );
+
+void test_modulus( mpz_t N, gmp_randstate_t state, mp_bitcnt_t max_bits );
+
+void test_elem( mpz_t x, gmp_randstate_t state, mpz_t N );
+
+void test_group( mpz_t p, mpz_t q, mpz_t g, gmp_randstate_t state );
+
+int test_precomp_ready( elgamal_precomp_t pc, mpz_t h, size_t * head );
+
+int test_hex( gmp_randstate_t state );
+
+int test_montgomery( gmp_randstate_t state );
+
+int test_sliding_window( gmp_randstate_t state );
+
+int test_expm_schedule( gmp_randstate_t state );
+
+int test_barrett( gmp_randstate_t state );
+
+int test_multi_expm( gmp_randstate_t state );
+
+int test_mb_expm( gmp_randstate_t state );
+
+int test_fixed_base( gmp_randstate_t state );
+
+int test_modulus_cache( gmp_randstate_t state );
+
+int test_invertm_batch( gmp_randstate_t state );
+
+int test_rsa_crt( gmp_randstate_t state );
+
+int test_rsa_crt_multi( gmp_randstate_t state );
 
-void shift_limbs_1( const mp_limb_t * out, const mp_limb_t * in, size_t N_in );
+int test_elgamal( gmp_randstate_t state );
 
+int test_elgamal_precomp( gmp_randstate_t state );
 
+int test_csprng( gmp_randstate_t state );
 
 
 #endif